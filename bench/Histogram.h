@@ -0,0 +1,94 @@
+#ifndef MYSERVER_HISTOGRAM_H
+#define MYSERVER_HISTOGRAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// HDR style latency histogram: values below 128 are counted exactly, larger values in
+// log-linear buckets of 64 sub-buckets per power of two, so every recorded value is kept to
+// within about 1.5% whatever its magnitude. record() is one atomic increment and may be called
+// from any number of threads.
+class Histogram {
+public:
+    static constexpr int kSubBucketBits = 6;
+    static constexpr uint64_t kSubBuckets = uint64_t{1} << kSubBucketBits;
+    static constexpr uint64_t kLinearLimit = kSubBuckets * 2;
+    static constexpr int kMaxExponent = 48;
+
+    Histogram(): counts_(kLinearLimit + (kMaxExponent - kSubBucketBits) * kSubBuckets) {}
+
+    void record(int64_t value) {
+        uint64_t v = value < 0 ? 0 : static_cast<uint64_t>(value);
+        std::size_t index = index_of(v);
+        if (index >= counts_.size()) index = counts_.size() - 1;
+        counts_[index].fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while (v > max && !max_.compare_exchange_weak(max, v, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (const auto& count : counts_) total += count.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    uint64_t max() const {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    // Smallest recorded bucket value at or below which a fraction p of the values fall.
+    uint64_t percentile(double p) const {
+        uint64_t total = count();
+        if (total == 0) return 0;
+        auto rank = static_cast<uint64_t>(p * static_cast<double>(total));
+        if (rank >= total) rank = total - 1;
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i].load(std::memory_order_relaxed);
+            if (seen > rank) return std::min(value_at(i), max());
+        }
+        return max();
+    }
+
+    // One line in the same layout as report_latencies(), values in microseconds.
+    void print(const std::string& name) const {
+        auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+        std::cout << std::left << std::setw(32) << name << std::fixed << std::setprecision(1)
+                  << " p50 " << us(percentile(0.50)) << "us"
+                  << " p90 " << us(percentile(0.90)) << "us"
+                  << " p99 " << us(percentile(0.99)) << "us"
+                  << " p99.9 " << us(percentile(0.999)) << "us"
+                  << " max " << us(max()) << "us"
+                  << "  (" << count() << " samples)\n";
+    }
+
+private:
+    static std::size_t index_of(uint64_t v) {
+        if (v < kLinearLimit) return static_cast<std::size_t>(v);
+        int exponent = std::bit_width(v) - 1;             // >= kSubBucketBits + 1
+        int shift = exponent - kSubBucketBits;
+        uint64_t sub = (v >> shift) - kSubBuckets;         // [0, kSubBuckets)
+        return static_cast<std::size_t>(kLinearLimit + (shift - 1) * kSubBuckets + sub);
+    }
+
+    // Midpoint of the bucket at index.
+    static uint64_t value_at(std::size_t index) {
+        if (index < kLinearLimit) return index;
+        uint64_t offset = index - kLinearLimit;
+        int shift = static_cast<int>(offset / kSubBuckets) + 1;
+        uint64_t sub = offset % kSubBuckets + kSubBuckets;
+        return (sub << shift) + (uint64_t{1} << (shift - 1));
+    }
+
+    std::vector<std::atomic<uint64_t>> counts_;
+    std::atomic<uint64_t> max_{0};
+};
+
+#endif //MYSERVER_HISTOGRAM_H
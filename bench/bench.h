@@ -0,0 +1,82 @@
+#ifndef MYSERVER_BENCH_H
+#define MYSERVER_BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// Minimal benchmark registry. Each BENCHMARK(name) body runs once and reports its own results
+// through report()/report_latencies(), so a benchmark can measure whatever makes sense for it
+// (throughput, latency distribution, CPU time).
+struct Benchmark {
+    std::string name;
+    std::function<void()> run;
+};
+
+inline std::vector<Benchmark>& benchmark_registry() {
+    static std::vector<Benchmark> registry;
+    return registry;
+}
+
+inline bool register_benchmark(const std::string& name, std::function<void()> run) {
+    benchmark_registry().push_back({name, std::move(run)});
+    return true;
+}
+
+#define BENCHMARK(name) \
+    static void name(); \
+    static const bool name##_registered = register_benchmark(#name, name); \
+    static void name()
+
+inline int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Prevents the optimiser from discarding a value computed only for the benchmark.
+template<typename T>
+inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void report(const std::string& name, uint64_t ops, int64_t elapsed_ns, const std::string& extra = "") {
+    double seconds = static_cast<double>(elapsed_ns) / 1e9;
+    std::cout << std::left << std::setw(48) << name
+              << std::right << std::setw(12) << std::fixed << std::setprecision(1)
+              << static_cast<double>(elapsed_ns) / static_cast<double>(std::max<uint64_t>(ops, 1)) << " ns/op"
+              << std::setw(14) << std::setprecision(0) << static_cast<double>(ops) / seconds << " ops/s"
+              << (extra.empty() ? "" : "  " + extra) << "\n";
+}
+
+inline void report_latencies(const std::string& name, std::vector<int64_t>& samples_ns, const std::string& extra = "") {
+    if (samples_ns.empty()) return;
+    std::sort(samples_ns.begin(), samples_ns.end());
+    auto percentile = [&](double p) {
+        return samples_ns[std::min(samples_ns.size() - 1, static_cast<size_t>(p * static_cast<double>(samples_ns.size())))];
+    };
+    std::cout << std::left << std::setw(48) << name
+              << " p50 " << percentile(0.50) << "ns"
+              << " p99 " << percentile(0.99) << "ns"
+              << " p99.9 " << percentile(0.999) << "ns"
+              << " max " << samples_ns.back() << "ns"
+              << (extra.empty() ? "" : "  " + extra) << "\n";
+}
+
+// Self-checks inside a benchmark. bench exits non-zero if any of them failed.
+inline int& check_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+inline void check(bool ok, const std::string& what) {
+    std::cout << std::left << std::setw(48) << what << (ok ? " ok" : " FAILED") << "\n";
+    if (!ok) ++check_failures();
+}
+
+#endif //MYSERVER_BENCH_H
@@ -0,0 +1,20 @@
+#include <iostream>
+#include <string>
+
+#include "bench.h"
+
+// Usage: ./bench [name filter...]. With no arguments every registered benchmark runs. Exits
+// non-zero if a benchmark's self-check failed.
+int main(int argc, char* argv[]) {
+    for (auto& benchmark : benchmark_registry()) {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i) {
+            if (benchmark.name.find(argv[i]) != std::string::npos) selected = true;
+        }
+        if (!selected) continue;
+
+        std::cout << "== " << benchmark.name << "\n";
+        benchmark.run();
+    }
+    return check_failures() == 0 ? 0 : 1;
+}
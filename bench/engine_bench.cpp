@@ -0,0 +1,273 @@
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "Engine.h"
+#include "peer.h"
+
+// Hot paths of the distributor, each measured on its own:
+//   process_trade / process_positions: the shard worker's per-message work, run on the worker
+//   incoming_message_handler:          parse a received frame and hand its positions to the shard
+//   exposure check / audit:            pre-trade limit check, and full recomputation of the aggregates
+//                                      (also checks that audit catches a table write that bypassed them)
+//   send_message framing:              serialize a batch once and queue it on a connection
+//   event dispatch:                    Event<> invocation with one and several handlers
+
+namespace {
+
+constexpr std::size_t kSymbols = 1024;
+constexpr std::size_t kBatchPositions = 32;
+
+std::vector<std::string> symbol_names() {
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < kSymbols; ++i) {
+        names.push_back("SYM" + std::to_string(i));
+    }
+    return names;
+}
+
+PositionBatch make_batch(const std::string& strategy, std::size_t first_symbol, uint64_t seq) {
+    PositionBatch batch;
+    for (std::size_t i = 0; i < kBatchPositions; ++i) {
+        SymbolPos* pos = batch.add_positions();
+        pos->set_strategy_name(strategy);
+        pos->set_symbol("SYM" + std::to_string((first_symbol + i) % kSymbols));
+        pos->set_net_position(100.0 + static_cast<double>(i));
+        pos->set_timestamp(static_cast<int64_t>(seq));
+        pos->set_seq(seq);
+    }
+    return batch;
+}
+
+}
+
+// An engine with one shard and no peers. Anti-entropy is off, and the worker blocks when idle
+// so it does not compete with the benchmark thread for a core.
+class EngineBench {
+public:
+    EngineBench():
+            io_pool_(1),
+            peer_(std::make_shared<Peer>(io_pool_, 0)),
+            engine_(peer_, "bench", config())
+    {}
+
+    static EngineConfig config() {
+        EngineConfig config;
+        config.wait_strategy = WaitStrategyType::Blocking;
+        config.gossip_interval = std::chrono::milliseconds(0);
+        return config;
+    }
+
+    Engine& engine() {
+        return engine_;
+    }
+
+    // Runs f(engine, shard) on the shard worker and waits for it.
+    template<typename F>
+    void on_shard(F f) {
+        std::promise<void> done;
+        Shard& shard = *engine_.shards_[0];
+        engine_.post(shard, [&] {
+            f(engine_, shard);
+            done.set_value();
+        });
+        done.get_future().wait();
+    }
+
+    // Waits until the worker has consumed everything pushed so far.
+    void sync() {
+        on_shard([](Engine&, Shard&) {});
+    }
+
+    void process_trade(Shard& shard, Trade& trade) {
+        engine_.process_trade(shard, trade);
+    }
+
+    void process_positions(Shard& shard, SymbolPos& pos) {
+        engine_.process_positions(shard, pos);
+    }
+
+    void incoming_message_handler(const FrameView& frame) {
+        engine_.incoming_message_handler(nullptr, frame);
+    }
+
+private:
+    IoContextPool io_pool_;
+    std::shared_ptr<Peer> peer_;
+    Engine engine_;
+};
+
+
+BENCHMARK(engine_process_trade) {
+    set_log_level(LogLevel::Error);
+    constexpr uint64_t kTrades = 2'000'000;
+    EngineBench bench;
+    std::vector<Trade> trades;
+    for (const std::string& symbol : symbol_names()) {
+        Trade trade;
+        trade.set_symbol(symbol);
+        trade.set_position(1.0);
+        trades.push_back(trade);
+    }
+
+    int64_t elapsed = 0;
+    bench.on_shard([&](Engine&, Shard& shard) {
+        int64_t start = now_ns();
+        for (uint64_t i = 0; i < kTrades; ++i) {
+            bench.process_trade(shard, trades[i % trades.size()]);
+        }
+        elapsed = now_ns() - start;
+    });
+    report("engine_process_trade", kTrades, elapsed, "(1024 symbols, batches of 256 broadcast)");
+}
+
+BENCHMARK(engine_process_positions) {
+    set_log_level(LogLevel::Error);
+    constexpr uint64_t kPositions = 2'000'000;
+    constexpr std::size_t kStrategies = 8;
+    EngineBench bench;
+    std::vector<std::string> symbols = symbol_names();
+    std::vector<SymbolPos> positions(kSymbols * kStrategies);
+    for (std::size_t i = 0; i < positions.size(); ++i) {
+        positions[i].set_strategy_name("remote" + std::to_string(i % kStrategies));
+        positions[i].set_symbol(symbols[(i / kStrategies) % kSymbols]);
+    }
+
+    int64_t elapsed = 0;
+    bench.on_shard([&](Engine&, Shard& shard) {
+        int64_t start = now_ns();
+        for (uint64_t i = 0; i < kPositions; ++i) {
+            SymbolPos& pos = positions[i % positions.size()];
+            pos.set_net_position(static_cast<double>(i));
+            pos.set_timestamp(static_cast<int64_t>(i + 1));
+            pos.set_seq(i + 1);
+            bench.process_positions(shard, pos);
+        }
+        elapsed = now_ns() - start;
+    });
+    report("engine_process_positions", kPositions, elapsed, "(8 strategies x 1024 symbols, every update newer)");
+}
+
+BENCHMARK(exposure) {
+    constexpr uint64_t kChecks = 20'000'000;
+    constexpr std::size_t kStrategies = 8;
+    PositionTable table(kMaxStrategies, kMaxSymbols);
+    ExposureLimits limits;
+    limits.default_symbol = {1e6, 4e6};
+    limits.firm = {1e9, 1e9};
+    ShardExposure exposure(kMaxSymbols, limits);
+    // The way Engine::apply writes a cell.
+    auto book = [&](uint32_t strategy_id, uint32_t symbol_id, double net) {
+        Position& cell = table.at(strategy_id, symbol_id);
+        exposure.set(symbol_id, cell.net_position, net);
+        cell.net_position = net;
+    };
+    for (std::size_t i = 0; i < kMaxStrategies; ++i) {
+        table.strategies().intern("strategy" + std::to_string(i));
+    }
+    for (const std::string& symbol : symbol_names()) {
+        uint32_t symbol_id = table.symbols().intern(symbol);
+        for (uint32_t strategy_id = 0; strategy_id < kStrategies; ++strategy_id) {
+            book(strategy_id, symbol_id, static_cast<double>(strategy_id) - 3.5);
+        }
+    }
+
+    uint64_t rejected = 0;
+    int64_t start = now_ns();
+    for (uint64_t i = 0; i < kChecks; ++i) {
+        auto symbol_id = static_cast<uint32_t>(i % kSymbols);
+        rejected += exposure.check(symbol_id, table.symbols(), 1.0, 1.0 + static_cast<double>(i & 1023), 0, 0) != LimitCheck::Ok;
+    }
+    int64_t elapsed = now_ns() - start;
+    do_not_optimize(rejected);
+    report("exposure/check", kChecks, elapsed, "(symbol and firm net and gross limits)");
+
+    constexpr uint64_t kAudits = 200;
+    for (uint32_t strategy_id = 0; strategy_id < kMaxStrategies; ++strategy_id) {
+        for (uint32_t symbol_id = 0; symbol_id < kSymbols; ++symbol_id) {
+            book(strategy_id, symbol_id, static_cast<double>(strategy_id * kSymbols + symbol_id) * 0.25 - 1000);
+        }
+    }
+    start = now_ns();
+    for (uint64_t i = 0; i < kAudits; ++i) {
+        do_not_optimize(exposure.audit(table));
+    }
+    elapsed = now_ns() - start;
+    report("exposure/audit", kAudits, elapsed,
+           "(" + std::to_string(kMaxStrategies) + " strategies x " + std::to_string(kSymbols) + " symbols, "
+           + std::to_string(static_cast<double>(elapsed) / static_cast<double>(kAudits * kMaxStrategies * kSymbols)).substr(0, 4)
+           + " ns/cell)");
+
+    // A write that bypasses set() leaves the aggregates behind the table; audit must see it.
+    table.at(3, 7).net_position += 50;
+    ShardExposure::AuditResult drift = exposure.audit(table);
+    check(drift.max_symbol_error == 50 && drift.net_error == 50 && drift.gross_error == 50,
+          "exposure/audit detects a bypassing write");
+    drift = exposure.audit(table);
+    check(drift.max_symbol_error == 0 && drift.net_error == 0 && drift.gross_error == 0,
+          "exposure/audit rebases on the table");
+}
+
+BENCHMARK(engine_incoming_message_handler) {
+    set_log_level(LogLevel::Error);
+    constexpr uint64_t kFrames = 200'000;
+    EngineBench bench;
+    std::vector<std::string> payloads;
+    for (std::size_t i = 0; i < kSymbols / kBatchPositions; ++i) {
+        payloads.push_back(make_batch("remote", i * kBatchPositions, i + 1).SerializeAsString());
+    }
+
+    int64_t start = now_ns();
+    for (uint64_t i = 0; i < kFrames; ++i) {
+        const std::string& payload = payloads[i % payloads.size()];
+        bench.incoming_message_handler(FrameView{MessageType::PositionBatch, payload.data(), payload.size()});
+    }
+    bench.sync();
+    int64_t elapsed = now_ns() - start;
+    report("engine_incoming_message_handler", kFrames, elapsed,
+           "(PositionBatch of 32, " + std::to_string(elapsed / static_cast<int64_t>(kFrames * kBatchPositions)) + " ns/position)");
+}
+
+BENCHMARK(send_message_framing) {
+    constexpr uint64_t kFrames = 1'000'000;
+    boost::asio::io_context io;
+    auto connection = std::make_shared<Connection>(std::make_shared<tcp::socket>(io),
+                                                   std::make_shared<BufferPool>(64 * 1024, 1));
+    PositionBatch batch = make_batch("bench", 0, 1);
+
+    uint64_t bytes = 0;
+    int64_t start = now_ns();
+    for (uint64_t i = 0; i < kFrames; ++i) {
+        SharedFrame frame = make_frame(MessageType::PositionBatch, batch);
+        bytes += frame->size();
+        if (connection->enqueue(frame, 1 << 30) == Connection::EnqueueResult::StartWrite) {
+            do_not_optimize(connection->begin_write());
+            connection->finish_write();
+        }
+    }
+    int64_t elapsed = now_ns() - start;
+    report("send_message_framing", kFrames, elapsed,
+           "(PositionBatch of 32, " + std::to_string(bytes / kFrames) + " bytes/frame)");
+}
+
+BENCHMARK(event_dispatch) {
+    constexpr uint64_t kCalls = 20'000'000;
+    for (int handlers : {1, 4}) {
+        Event<const PositionUpdate&> event;
+        uint64_t sum = 0;
+        for (int i = 0; i < handlers; ++i) {
+            event += [&sum](const PositionUpdate& update) { sum += static_cast<uint64_t>(update.timestamp); };
+        }
+        PositionUpdate update{"bench", "SYM0", 1.0, 0};
+        int64_t start = now_ns();
+        for (uint64_t i = 0; i < kCalls; ++i) {
+            update.timestamp = static_cast<int64_t>(i);
+            event(update);
+        }
+        int64_t elapsed = now_ns() - start;
+        do_not_optimize(sum);
+        report("event_dispatch/" + std::to_string(handlers) + "_handlers", kCalls, elapsed);
+    }
+}
@@ -0,0 +1,364 @@
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.h"
+#include "Engine.h"
+#include "Histogram.h"
+#include "Membership.h"
+#include "peer.h"
+
+// Starts N distributors in one process, fully meshed over loopback TCP, drives trades into them
+// round robin at a fixed rate and measures how long each trade takes to be applied by the other
+// peers. Every trade adds 1 to a symbol of the peer it is sent to, so a remote net position of n
+// identifies the n-th trade on that (peer, symbol), whose send time is kept in a small ring per
+// (peer, symbol). With coalescing on, only the last trade of each batch is seen remotely and
+// measured. Updates that arrive more than kSendRing trades late are counted but not measured.
+// With --registry the peers find each other through an in-process Registry instead, and with
+// --relays=K the first K of them are relays that the others connect to.
+
+namespace {
+
+struct Options {
+    std::size_t peers = 3;
+    uint64_t rate = 100'000;        // trades per second over all peers, 0 = as fast as possible
+    double seconds = 5;
+    std::size_t symbols = 1000;
+    unsigned short base_port = 24000;
+    EngineConfig engine;
+    PeerConfig peer;
+    std::size_t io_threads = 1;
+    bool registry = false;
+    std::size_t relays = 0;
+};
+
+struct Node {
+    std::unique_ptr<IoContextPool> io_pool;
+    std::shared_ptr<Peer> peer;
+    std::unique_ptr<Engine> engine;
+    std::unique_ptr<MembershipClient> membership;
+};
+
+constexpr uint64_t kSendRing = 64;
+
+std::string strategy_name(std::size_t index) {
+    return "peer" + std::to_string(index);
+}
+
+std::string symbol_name(std::size_t index) {
+    return "LG" + std::to_string(index);
+}
+
+// Parses the number after prefix in text, or returns false.
+bool parse_index(std::string_view text, std::string_view prefix, std::size_t& index) {
+    if (text.substr(0, prefix.size()) != prefix) return false;
+    auto [end, ec] = std::from_chars(text.data() + prefix.size(), text.data() + text.size(), index);
+    return ec == std::errc() && end == text.data() + text.size();
+}
+
+class LoadGenerator {
+public:
+    explicit LoadGenerator(const Options& options):
+            options_(options),
+            total_trades_(static_cast<uint64_t>(static_cast<double>(options.rate) * options.seconds)),
+            sent_(options.peers * options.symbols * kSendRing)
+    {}
+
+    void start() {
+        auto registry_port = static_cast<unsigned short>(options_.base_port + options_.peers);
+        if (options_.registry) {
+            registry_ = std::make_unique<Registry>(registry_io_, registry_port);
+            registry_thread_ = std::thread([this] { registry_io_.run(); });
+        }
+        for (std::size_t i = 0; i < options_.peers; ++i) {
+            Node node;
+            node.io_pool = std::make_unique<IoContextPool>(options_.io_threads);
+            PeerConfig peer_config = options_.peer;
+            peer_config.name = strategy_name(i);
+            peer_config.relay = i < options_.relays;
+            node.peer = std::make_shared<Peer>(*node.io_pool, static_cast<unsigned short>(options_.base_port + i), peer_config);
+            node.engine = std::make_unique<Engine>(node.peer, strategy_name(i), options_.engine);
+            node.engine->position_changed += [this, i](const PositionUpdate& update) { on_position(i, update); };
+            if (options_.registry) {
+                node.membership = std::make_unique<MembershipClient>(node.io_pool->get(0), node.peer, "127.0.0.1", registry_port,
+                                                                     member(i));
+            }
+            nodes_.push_back(std::move(node));
+        }
+        for (std::size_t i = 0; i < options_.peers; ++i) {
+            nodes_[i].io_pool->run();
+            if (options_.registry) {
+                nodes_[i].membership->start();
+                continue;
+            }
+            for (std::size_t j = 0; j < i; ++j) {
+                nodes_[i].peer->connect_to_peer("127.0.0.1", static_cast<unsigned short>(options_.base_port + j));
+            }
+        }
+    }
+
+    // Waits until every peer has the connections its topology gives it.
+    bool wait_for_mesh(std::chrono::seconds timeout) {
+        std::vector<std::size_t> expected = expected_connections();
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (std::chrono::steady_clock::now() < deadline) {
+            bool meshed = true;
+            for (std::size_t i = 0; i < nodes_.size(); ++i) {
+                meshed = meshed && nodes_[i].peer->connections().size() >= expected[i];
+            }
+            if (meshed) return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    // Sends trades from this thread until the duration is over. Returns the number sent.
+    uint64_t drive() {
+        std::vector<std::vector<Trade>> trades(options_.peers);
+        for (std::size_t peer = 0; peer < options_.peers; ++peer) {
+            for (std::size_t symbol = 0; symbol < options_.symbols; ++symbol) {
+                Trade trade;
+                trade.set_symbol(symbol_name(symbol));
+                trade.set_position(1.0);
+                trades[peer].push_back(trade);
+            }
+        }
+
+        int64_t interval = options_.rate > 0 ? static_cast<int64_t>(1e9 / static_cast<double>(options_.rate)) : 0;
+        int64_t start = now_ns();
+        int64_t end = start + static_cast<int64_t>(options_.seconds * 1e9);
+        uint64_t sent = 0;
+        while (options_.rate == 0 ? now_ns() < end : sent < total_trades_) {
+            if (interval > 0) {
+                int64_t due = start + static_cast<int64_t>(sent) * interval;
+                int64_t wait = due - now_ns();
+                if (wait > 100'000) std::this_thread::sleep_for(std::chrono::nanoseconds(wait - 50'000));
+                while (now_ns() < due) {}
+            }
+            std::size_t peer = sent % options_.peers;
+            std::size_t symbol = (sent / options_.peers) % options_.symbols;
+            uint64_t n = sent / (options_.peers * options_.symbols);
+            SendTime& send_time = sent_[slot(peer, symbol, n)];
+            send_time.n.store(0, std::memory_order_relaxed);
+            send_time.at.store(now_ns(), std::memory_order_release);
+            send_time.n.store(n + 1, std::memory_order_release);
+            nodes_[peer].engine->push_trade(trades[peer][symbol]);
+            ++sent;
+        }
+        drive_ns_ = now_ns() - start;
+        return sent;
+    }
+
+    // Most peer connections any one peer holds.
+    std::size_t max_connections() {
+        std::size_t most = 0;
+        for (auto& node : nodes_) {
+            most = std::max(most, node.peer->connections().size());
+        }
+        return most;
+    }
+
+    void stop() {
+        // Network threads call into the engines, so they stop before any engine is destroyed.
+        for (auto& node : nodes_) {
+            node.io_pool->stop();
+            node.io_pool->join();
+        }
+        nodes_.clear();
+        if (registry_) {
+            registry_io_.stop();
+            registry_thread_.join();
+            registry_.reset();
+        }
+    }
+
+    // Number of (peer, remote strategy) views that match the owner's own positions exactly;
+    // there are peers * (peers - 1) views in all.
+    std::size_t converged_views() {
+        std::vector<std::map<std::string, double>> owned(nodes_.size());
+        for (std::size_t origin = 0; origin < nodes_.size(); ++origin) {
+            for (const PositionEntry& entry : nodes_[origin].engine->strategy_positions(strategy_name(origin))) {
+                owned[origin][entry.symbol] = entry.net_position;
+            }
+        }
+        std::size_t converged = 0;
+        for (std::size_t receiver = 0; receiver < nodes_.size(); ++receiver) {
+            for (std::size_t origin = 0; origin < nodes_.size(); ++origin) {
+                if (origin == receiver) continue;
+                std::map<std::string, double> seen;
+                for (const PositionEntry& entry : nodes_[receiver].engine->strategy_positions(strategy_name(origin))) {
+                    seen[entry.symbol] = entry.net_position;
+                }
+                if (seen == owned[origin]) ++converged;
+            }
+        }
+        return converged;
+    }
+
+    const Histogram& latency() const {
+        return latency_;
+    }
+
+    uint64_t remote_updates() const {
+        return remote_updates_.load(std::memory_order_relaxed);
+    }
+
+    int64_t drive_ns() const {
+        return drive_ns_;
+    }
+
+private:
+    Member member(std::size_t index) const {
+        Member member;
+        member.set_name(strategy_name(index));
+        member.set_host("127.0.0.1");
+        member.set_port(static_cast<uint32_t>(options_.base_port + index));
+        member.set_relay(index < options_.relays);
+        return member;
+    }
+
+    // Connections each peer ends up with: the ones it dials plus the ones dialled to it.
+    std::vector<std::size_t> expected_connections() const {
+        std::vector<std::size_t> expected(options_.peers, options_.peers - 1);
+        if (!options_.registry) return expected;
+        Membership view;
+        for (std::size_t i = 0; i < options_.peers; ++i) {
+            *view.add_members() = member(i);
+        }
+        std::fill(expected.begin(), expected.end(), 0);
+        for (std::size_t i = 0; i < options_.peers; ++i) {
+            for (const Member& target : dial_targets(member(i), view)) {
+                std::size_t j;
+                parse_index(target.name(), "peer", j);
+                ++expected[i];
+                ++expected[j];
+            }
+        }
+        return expected;
+    }
+
+    // When the n-th trade on a symbol was sent; n is zero while at is being rewritten.
+    struct SendTime {
+        std::atomic<uint64_t> n{0};
+        std::atomic<int64_t> at{0};
+    };
+
+    std::size_t slot(std::size_t peer, std::size_t symbol, uint64_t n) const {
+        return (peer * options_.symbols + symbol) * kSendRing + n % kSendRing;
+    }
+
+    // Runs on the shard workers of node receiver.
+    void on_position(std::size_t receiver, const PositionUpdate& update) {
+        std::size_t origin, symbol;
+        if (!parse_index(update.strategy, "peer", origin) || origin == receiver) return;
+        remote_updates_.fetch_add(1, std::memory_order_relaxed);
+        if (!parse_index(update.symbol, "LG", symbol)) return;
+        auto n = std::llround(update.net_position);
+        if (origin >= options_.peers || symbol >= options_.symbols || n < 1) return;
+        const SendTime& send_time = sent_[slot(origin, symbol, static_cast<uint64_t>(n - 1))];
+        uint64_t before = send_time.n.load(std::memory_order_acquire);
+        int64_t sent_at = send_time.at.load(std::memory_order_acquire);
+        if (before == static_cast<uint64_t>(n) && send_time.n.load(std::memory_order_acquire) == before) {
+            latency_.record(now_ns() - sent_at);
+        }
+    }
+
+    Options options_;
+    uint64_t total_trades_;
+    std::vector<SendTime> sent_;
+    std::vector<Node> nodes_;
+    asio::io_context registry_io_;
+    std::unique_ptr<Registry> registry_;
+    std::thread registry_thread_;
+    Histogram latency_;
+    std::atomic<uint64_t> remote_updates_{0};
+    int64_t drive_ns_ = 0;
+};
+
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> args;
+    auto flags = parse_flags(argc, argv, args);
+    if (flags.count("help")) {
+        std::cerr << "Usage: " << argv[0] << " [options]\n"
+                  << "Options:\n"
+                  << "  --peers=N                    distributors in the mesh (default 3)\n"
+                  << "  --rate=N                     trades per second over all peers, 0 = unthrottled (default 100000)\n"
+                  << "  --seconds=S                  how long to send trades (default 5)\n"
+                  << "  --symbols=N                  symbols traded per peer (default 1000)\n"
+                  << "  --base-port=P                peer i listens on P + i (default 24000)\n"
+                  << "  --shards=N                   engine shards per peer (default 1)\n"
+                  << "  --io-threads=N               network threads per peer (default 1)\n"
+                  << "  --wait=spin|backoff|block    shard wait strategy (default backoff)\n"
+                  << "  --coalesce-us=N              broadcast coalescing window (default 0)\n"
+                  << "  --coalesce-max=N             max positions per broadcast batch (default 256)\n"
+                  << "  --no-shm                     connect the peers over TCP instead of shared memory\n"
+                  << "  --shm-ring-bytes=N           shared-memory ring size per direction (default 1MB)\n"
+                  << "  --multicast=GROUP:PORT       broadcast on a multicast group over loopback instead of TCP\n"
+                  << "  --registry                   connect the peers through a membership registry on P + peers\n"
+                  << "  --relays=K                   make the first K peers relays (implies --registry)\n";
+        return 1;
+    }
+
+    set_log_level(LogLevel::Error);
+
+    Options options;
+    options.engine.wait_strategy = WaitStrategyType::Backoff;
+    options.engine.gossip_interval = std::chrono::milliseconds(0);
+    if (flags.count("peers")) options.peers = std::max<std::size_t>(std::stoul(flags["peers"]), 2);
+    if (flags.count("rate")) options.rate = std::stoull(flags["rate"]);
+    if (flags.count("seconds")) options.seconds = std::stod(flags["seconds"]);
+    if (flags.count("symbols")) options.symbols = std::max<std::size_t>(std::stoul(flags["symbols"]), 1);
+    if (flags.count("base-port")) options.base_port = static_cast<unsigned short>(std::stoul(flags["base-port"]));
+    if (flags.count("shards")) options.engine.shard_count = std::stoul(flags["shards"]);
+    if (flags.count("io-threads")) options.io_threads = std::stoul(flags["io-threads"]);
+    if (flags.count("wait")) options.engine.wait_strategy = parse_wait_strategy(flags["wait"]);
+    if (flags.count("coalesce-us")) options.engine.coalesce_window = std::chrono::microseconds(std::stol(flags["coalesce-us"]));
+    if (flags.count("coalesce-max")) options.engine.coalesce_max_batch = std::stoul(flags["coalesce-max"]);
+    if (flags.count("no-shm")) options.peer.shared_memory = false;
+    if (flags.count("shm-ring-bytes")) options.peer.shm_ring_bytes = std::stoul(flags["shm-ring-bytes"]);
+    if (flags.count("multicast")) {
+        const std::string& group_port = flags["multicast"];
+        size_t colon = group_port.find(':');
+        options.peer.multicast_group = group_port.substr(0, colon);
+        options.peer.multicast_port = static_cast<unsigned short>(std::stoul(group_port.substr(colon + 1)));
+        options.peer.multicast_interface = "127.0.0.1";
+    }
+    if (flags.count("registry")) options.registry = true;
+    if (flags.count("relays")) {
+        options.relays = std::stoul(flags["relays"]);
+        options.registry = true;
+    }
+    options.engine.network_threads = options.io_threads;
+
+    LoadGenerator generator(options);
+    generator.start();
+    if (!generator.wait_for_mesh(std::chrono::seconds(10))) {
+        std::cerr << "Peers did not connect to each other\n";
+        generator.stop();
+        return 1;
+    }
+
+    uint64_t sent = generator.drive();
+    // Let the last broadcasts arrive.
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    double seconds = static_cast<double>(generator.drive_ns()) / 1e9;
+    std::cout << options.peers << " peers, " << options.symbols << " symbols, "
+              << std::fixed << std::setprecision(1) << seconds << "s\n"
+              << std::setprecision(0)
+              << "trades sent        " << sent << " (" << static_cast<double>(sent) / seconds << "/s)\n"
+              << "remote updates     " << generator.remote_updates() << " of " << sent * (options.peers - 1)
+              << " (" << static_cast<double>(generator.remote_updates()) / seconds << "/s)\n";
+    std::cout << "converged views    " << generator.converged_views() << " of " << options.peers * (options.peers - 1) << "\n"
+              << "max connections    " << generator.max_connections() << " per peer\n";
+    generator.latency().print("trade to remote apply");
+    generator.stop();
+}
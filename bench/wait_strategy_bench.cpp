@@ -0,0 +1,137 @@
+#include <atomic>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <thread>
+#include <time.h>
+
+#include "bench.h"
+#include "WaitStrategy.h"
+
+// Compares the shard wait strategies on the same SPSC queue + Signal pair that Engine uses:
+//   throughput: producer pushes as fast as it can into a small queue, so both sides wait
+//   latency:    producer sends one message every 50us, consumer records enqueue-to-dequeue time
+//   idle cpu:   consumer waits on an empty queue, we measure the CPU time it burns
+
+namespace {
+
+constexpr std::size_t kQueueCapacity = 1024;
+
+struct Channel {
+    explicit Channel(WaitStrategyType type): wait_strategy(type), queue(kQueueCapacity) {}
+
+    WaitStrategy wait_strategy;
+    boost::lockfree::spsc_queue<int64_t> queue;
+    Signal data_ready;
+    Signal space_ready;
+    std::atomic<bool> running{true};
+
+    void push(int64_t value) {
+        unsigned spins = 0;
+        while (true) {
+            uint32_t epoch = space_ready.epoch();
+            if (queue.push(value)) break;
+            wait_strategy.wait(space_ready, epoch, spins);
+        }
+        wait_strategy.notify(data_ready);
+    }
+
+    // Returns false once running is cleared and the queue is empty.
+    template<typename F>
+    bool consume(F&& on_value) {
+        unsigned spins = 0;
+        while (true) {
+            uint32_t epoch = data_ready.epoch();
+            if (queue.consume_all(on_value) > 0) {
+                wait_strategy.notify(space_ready);
+                return true;
+            }
+            if (!running.load(std::memory_order_acquire)) return false;
+            wait_strategy.wait(data_ready, epoch, spins);
+        }
+    }
+
+    void stop() {
+        running.store(false, std::memory_order_release);
+        data_ready.notify();
+    }
+};
+
+int64_t thread_cpu_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void throughput(WaitStrategyType type) {
+    constexpr int64_t kMessages = 2000000;
+    Channel channel(type);
+    int64_t received = 0;
+    std::thread consumer([&] {
+        while (channel.consume([&](int64_t) { ++received; })) {}
+    });
+
+    int64_t start = now_ns();
+    for (int64_t i = 0; i < kMessages; ++i) {
+        channel.push(i);
+    }
+    channel.stop();
+    consumer.join();
+    report("wait_strategy/throughput/" + to_string(type), received, now_ns() - start);
+}
+
+void paced_latency(WaitStrategyType type) {
+    constexpr int kMessages = 20000;
+    Channel channel(type);
+    std::vector<int64_t> samples;
+    samples.reserve(kMessages);
+    int64_t consumer_cpu = 0;
+    std::thread consumer([&] {
+        while (channel.consume([&](int64_t sent) { samples.push_back(now_ns() - sent); })) {}
+        consumer_cpu = thread_cpu_ns();
+    });
+
+    int64_t start = now_ns();
+    for (int i = 0; i < kMessages; ++i) {
+        channel.push(now_ns());
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+    channel.stop();
+    consumer.join();
+    int64_t elapsed = now_ns() - start;
+    report_latencies("wait_strategy/latency@50us/" + to_string(type), samples,
+                     "consumer cpu " + std::to_string(100 * consumer_cpu / elapsed) + "%");
+}
+
+void idle_cpu(WaitStrategyType type) {
+    Channel channel(type);
+    int64_t consumer_cpu = 0;
+    std::thread consumer([&] {
+        while (channel.consume([](int64_t) {})) {}
+        consumer_cpu = thread_cpu_ns();
+    });
+
+    int64_t start = now_ns();
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    channel.stop();
+    consumer.join();
+    int64_t elapsed = now_ns() - start;
+    std::cout << std::left << std::setw(48) << "wait_strategy/idle_cpu/" + to_string(type)
+              << " consumer cpu " << 100 * consumer_cpu / elapsed << "%\n";
+}
+
+const WaitStrategyType kStrategies[] = {
+        WaitStrategyType::BusySpin, WaitStrategyType::Backoff, WaitStrategyType::Blocking
+};
+
+}
+
+BENCHMARK(wait_strategy_throughput) {
+    for (auto type : kStrategies) throughput(type);
+}
+
+BENCHMARK(wait_strategy_latency) {
+    for (auto type : kStrategies) paced_latency(type);
+}
+
+BENCHMARK(wait_strategy_idle_cpu) {
+    for (auto type : kStrategies) idle_cpu(type);
+}
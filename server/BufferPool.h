@@ -0,0 +1,47 @@
+#ifndef MYSERVER_BUFFERPOOL_H
+#define MYSERVER_BUFFERPOOL_H
+
+#include <mutex>
+#include <vector>
+
+
+// Recycles receive buffers between connections. Buffers are only taken and returned when a
+// connection opens or closes, so a mutex is plenty.
+class BufferPool {
+public:
+    BufferPool(std::size_t buffer_size, std::size_t max_pooled):
+            buffer_size_(buffer_size),
+            max_pooled_(max_pooled)
+    {}
+
+    std::vector<char> acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (buffers_.empty()) {
+            return std::vector<char>(buffer_size_);
+        }
+        std::vector<char> buffer = std::move(buffers_.back());
+        buffers_.pop_back();
+        return buffer;
+    }
+
+    // Buffers that grew to fit an unusually large frame are dropped instead of pooled.
+    void release(std::vector<char>&& buffer) {
+        if (buffer.size() != buffer_size_) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (buffers_.size() < max_pooled_) {
+            buffers_.push_back(std::move(buffer));
+        }
+    }
+
+    std::size_t buffer_size() const {
+        return buffer_size_;
+    }
+
+private:
+    std::size_t buffer_size_;
+    std::size_t max_pooled_;
+    std::vector<std::vector<char>> buffers_;
+    std::mutex mutex_;
+};
+
+#endif //MYSERVER_BUFFERPOOL_H
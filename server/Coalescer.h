@@ -0,0 +1,76 @@
+#ifndef MYSERVER_COALESCER_H
+#define MYSERVER_COALESCER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+
+// Collects the symbols whose own position changed since the last broadcast. Only the symbol id
+// is remembered: the latest net position is read back from the position table at flush time,
+// so any number of fills on a symbol within one window collapse into a single entry.
+//
+// A window closes when it has been open for window, or when max_batch distinct symbols are
+// pending. A zero window closes after every pass over the shard queues, which still merges
+// fills that arrived in the same burst.
+class Coalescer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    Coalescer(std::chrono::microseconds window, std::size_t max_batch, std::size_t max_symbols):
+            window_(window),
+            max_batch_(std::max<std::size_t>(max_batch, 1)),
+            pending_mark_(max_symbols, 0)
+    {
+        pending_.reserve(max_batch_);
+    }
+
+    void add(uint32_t symbol_id) {
+        if (pending_mark_[symbol_id]) return;
+        if (pending_.empty()) {
+            deadline_ = Clock::now() + window_;
+        }
+        pending_mark_[symbol_id] = 1;
+        pending_.push_back(symbol_id);
+    }
+
+    bool empty() const {
+        return pending_.empty();
+    }
+
+    bool full() const {
+        return pending_.size() >= max_batch_;
+    }
+
+    bool expired(Clock::time_point now) const {
+        return !pending_.empty() && now >= deadline_;
+    }
+
+    bool immediate() const {
+        return window_.count() == 0;
+    }
+
+    Clock::time_point deadline() const {
+        return deadline_;
+    }
+
+    // Hands the pending symbol ids to f and starts a new window.
+    template<typename F>
+    void flush(F&& f) {
+        f(pending_);
+        for (uint32_t symbol_id : pending_) {
+            pending_mark_[symbol_id] = 0;
+        }
+        pending_.clear();
+    }
+
+private:
+    std::chrono::microseconds window_;
+    std::size_t max_batch_;
+    Clock::time_point deadline_;
+    std::vector<uint32_t> pending_;
+    std::vector<uint8_t> pending_mark_;
+};
+
+#endif //MYSERVER_COALESCER_H
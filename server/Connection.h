@@ -0,0 +1,263 @@
+#ifndef MYSERVER_CONNECTION_H
+#define MYSERVER_CONNECTION_H
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BufferPool.h"
+#include "Frame.h"
+#include "Metrics.h"
+#include "ShmChannel.h"
+
+using boost::asio::ip::tcp;
+
+
+// Per-connection state owned by Peer. The receive buffer comes from a BufferPool and is reused
+// for every read on the connection: a read appends whatever the socket has to the free tail,
+// every complete frame is handed out in place, and a partial frame is kept for the next read.
+//
+// Outgoing frames are queued per connection and written by a single chain of gather writes, so
+// writes on one socket never interleave. Any thread may enqueue; the write chain itself only
+// runs on the network thread.
+//
+// Once a shared-memory channel is attached, frames that fit go into its outbound ring instead,
+// still under the write mutex; frames the ring has no room for wait in order in shm_pending_.
+// The socket keeps carrying control frames and anything too large for the ring.
+class Connection {
+public:
+    static constexpr std::size_t kMaxGatherFrames = 64;
+
+    enum class EnqueueResult {
+        Queued,       // a write chain is already running and will pick the frame up
+        StartWrite,   // the caller must start the write chain
+        Overflow,     // the queue crossed the high-water mark, the caller must close the connection
+        Dropped       // the connection already overflowed
+    };
+
+    Connection(std::shared_ptr<tcp::socket> socket, std::shared_ptr<BufferPool> buffer_pool):
+            socket(std::move(socket)),
+            buffer_pool_(std::move(buffer_pool)),
+            buffer_(buffer_pool_->acquire())
+    {
+        boost::system::error_code ec;
+        auto remote_ep = this->socket->remote_endpoint(ec);
+        name = ec ? std::string("<unknown>") : remote_ep.address().to_string() + ":" + std::to_string(remote_ep.port());
+    }
+
+    ~Connection() {
+        buffer_pool_->release(std::move(buffer_));
+    }
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    // Free space at the end of the receive buffer, making room first if necessary.
+    boost::asio::mutable_buffer prepare_read() {
+        if (end_ == buffer_.size() || begin_ + pending_frame_size_ > buffer_.size()) {
+            compact();
+        }
+        if (end_ == buffer_.size() || pending_frame_size_ > buffer_.size()) {
+            buffer_.resize(std::max(buffer_.size() * 2, pending_frame_size_));
+        }
+        return boost::asio::buffer(buffer_.data() + end_, buffer_.size() - end_);
+    }
+
+    // Records bytes_read new bytes and calls on_frame(FrameView) for every complete frame.
+    // Returns false on a malformed header, after which the connection must be closed.
+    template<typename F>
+    bool commit_read(std::size_t bytes_read, F&& on_frame) {
+        end_ += bytes_read;
+        while (end_ - begin_ >= kFrameHeaderSize) {
+            FrameHeader header{};
+            if (!decode_frame_header(buffer_.data() + begin_, header)) {
+                return false;
+            }
+            std::size_t frame_size = kFrameHeaderSize + header.length;
+            if (end_ - begin_ < frame_size) {
+                pending_frame_size_ = frame_size;
+                return true;
+            }
+            on_frame(FrameView{header.type, buffer_.data() + begin_ + kFrameHeaderSize, header.length, header.flags});
+            begin_ += frame_size;
+        }
+        pending_frame_size_ = 0;
+        if (begin_ == end_) {
+            begin_ = end_ = 0;
+        }
+        return true;
+    }
+
+    EnqueueResult enqueue(const SharedFrame& frame, std::size_t high_water_mark) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (overflowed_) return EnqueueResult::Dropped;
+        if (queued_bytes_ + frame->size() > high_water_mark) {
+            overflowed_ = true;
+            return EnqueueResult::Overflow;
+        }
+        write_queue_.push_back(frame);
+        queued_bytes_ += frame->size();
+        if (writing_) return EnqueueResult::Queued;
+        writing_ = true;
+        return EnqueueResult::StartWrite;
+    }
+
+    // Moves up to kMaxGatherFrames queued frames in flight and returns one buffer per frame.
+    // The buffers stay valid until finish_write().
+    const std::vector<boost::asio::const_buffer>& begin_write() {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        gather_.clear();
+        while (!write_queue_.empty() && in_flight_.size() < kMaxGatherFrames) {
+            in_flight_.push_back(std::move(write_queue_.front()));
+            write_queue_.pop_front();
+            gather_.emplace_back(in_flight_.back()->data(), in_flight_.back()->size());
+        }
+        return gather_;
+    }
+
+    // Releases the frames written by the last begin_write(). Returns true if more frames are
+    // queued and the chain should continue, false once the queue is drained.
+    bool finish_write() {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        for (const auto& frame : in_flight_) {
+            queued_bytes_ -= frame->size();
+        }
+        in_flight_.clear();
+        if (write_queue_.empty()) {
+            writing_ = false;
+            return false;
+        }
+        return true;
+    }
+
+    std::size_t queued_bytes() {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        return queued_bytes_ + shm_pending_bytes_;
+    }
+
+    // Switches later frames to the shared-memory channel. Called on the network thread.
+    void attach_shm(std::unique_ptr<ShmChannel> channel) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        shm_ = std::move(channel);
+        shm_max_frame_ = shm_->outbound().max_frame();
+        shm_attached_.store(true, std::memory_order_release);
+    }
+
+    bool uses_shm(const SharedFrame& frame) const {
+        return shm_attached_.load(std::memory_order_acquire) && frame->size() <= shm_max_frame_;
+    }
+
+    // The attached channel, for the network thread; nullptr while on TCP only.
+    ShmChannel* shm() {
+        return shm_attached_.load(std::memory_order_acquire) ? shm_.get() : nullptr;
+    }
+
+    // Like enqueue(), for a frame that uses_shm(). StartWrite means the receiver was idle and the
+    // caller must ring its doorbell.
+    EnqueueResult enqueue_shm(const SharedFrame& frame, std::size_t high_water_mark) {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        if (overflowed_) return EnqueueResult::Dropped;
+        ShmRing& ring = shm_->outbound();
+        if (shm_pending_.empty() && ring.try_write(*frame)) {
+            stats.shm_bytes_sent.add(frame->size());
+            stats.shm_frames_sent.add();
+            return ring.take_reader_waiting() ? EnqueueResult::StartWrite : EnqueueResult::Queued;
+        }
+        if (queued_bytes_ + shm_pending_bytes_ + frame->size() > high_water_mark) {
+            overflowed_ = true;
+            return EnqueueResult::Overflow;
+        }
+        shm_pending_.push_back(frame);
+        shm_pending_bytes_ += frame->size();
+        return flush_shm_locked() ? EnqueueResult::StartWrite : EnqueueResult::Queued;
+    }
+
+    // Moves frames waiting for ring space into the ring. Returns true if the receiver has to be
+    // woken.
+    bool flush_shm() {
+        std::lock_guard<std::mutex> lock(write_mutex_);
+        return flush_shm_locked();
+    }
+
+public:
+    // Traffic counters, updated on the connection's network thread only.
+    struct Stats {
+        Counter bytes_received;
+        Counter frames_received;
+        Counter bytes_sent;
+        Counter frames_sent;
+        // Written into the shared-memory ring, under the write mutex rather than on one thread.
+        Counter shm_bytes_sent;
+        Counter shm_frames_sent;
+    };
+
+    std::shared_ptr<tcp::socket> socket;
+    std::string name;   // remote host:port, captured once at connect time
+    Stats stats;
+
+    // The name this side dialled the connection under, empty for accepted ones. Set before the
+    // connection is shared.
+    std::string dialled;
+    // Who is on the other end, from its PeerHello. Guarded by Peer's connections mutex.
+    std::string member;
+    bool relay = false;
+
+    // Shared-memory handshake state, network thread only: the segment offered to the peer until
+    // it answers, and whether the peer has started writing to the inbound ring.
+    std::unique_ptr<ShmChannel> offered_shm;
+    bool shm_inbound_ready = false;
+
+private:
+    bool flush_shm_locked() {
+        if (!shm_ || shm_pending_.empty()) return false;
+        ShmRing& ring = shm_->outbound();
+        bool wrote = false;
+        while (!shm_pending_.empty()) {
+            ring.set_writer_waiting(true);
+            const SharedFrame& frame = shm_pending_.front();
+            if (!ring.try_write(*frame)) break;
+            stats.shm_bytes_sent.add(frame->size());
+            stats.shm_frames_sent.add();
+            shm_pending_bytes_ -= frame->size();
+            shm_pending_.pop_front();
+            wrote = true;
+        }
+        if (shm_pending_.empty()) ring.set_writer_waiting(false);
+        return wrote && ring.take_reader_waiting();
+    }
+
+    void compact() {
+        if (begin_ == 0) return;
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+
+    std::shared_ptr<BufferPool> buffer_pool_;
+    std::vector<char> buffer_;
+    std::size_t begin_ = 0;
+    std::size_t end_ = 0;
+    std::size_t pending_frame_size_ = 0;   // size of the partially received frame, if known
+
+    std::mutex write_mutex_;
+    std::deque<SharedFrame> write_queue_;
+    std::vector<SharedFrame> in_flight_;
+    std::vector<boost::asio::const_buffer> gather_;
+    std::size_t queued_bytes_ = 0;         // queued + in flight
+    bool writing_ = false;
+    bool overflowed_ = false;
+
+    std::unique_ptr<ShmChannel> shm_;
+    std::atomic<bool> shm_attached_{false};
+    std::size_t shm_max_frame_ = 0;
+    std::deque<SharedFrame> shm_pending_;
+    std::size_t shm_pending_bytes_ = 0;
+};
+
+#endif //MYSERVER_CONNECTION_H
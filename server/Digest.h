@@ -0,0 +1,110 @@
+#ifndef MYSERVER_DIGEST_H
+#define MYSERVER_DIGEST_H
+
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "PositionTable.h"
+
+// Anti-entropy digests. Every strategy's positions are spread over kDigestBuckets buckets by a
+// hash of the symbol, and each bucket hash is the XOR of the hashes of the (symbol, net
+// position, timestamp) cells in it. XOR makes the digest cheap to keep up to date (remove the old
+// cell, add the new one) and lets the digests of several shards be merged, so two peers get
+// the same digest for the same book whatever their shard counts.
+//
+// The hashes only use FNV-1a and fixed mixing, never std::hash, so every build agrees on them.
+
+constexpr std::size_t kDigestBuckets = 64;
+
+using DigestBuckets = std::array<uint64_t, kDigestBuckets>;
+using BucketSet = std::bitset<kDigestBuckets>;
+
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    x ^= x >> 31;
+    return x;
+}
+
+inline uint64_t symbol_key(std::string_view symbol) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (char c : symbol) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+inline std::size_t digest_bucket(uint64_t key) {
+    return mix64(key) % kDigestBuckets;
+}
+
+inline uint64_t cell_hash(uint64_t key, double net_position, int64_t timestamp) {
+    uint64_t net_bits;
+    std::memcpy(&net_bits, &net_position, sizeof(net_bits));
+    return mix64(key ^ mix64(net_bits ^ mix64(static_cast<uint64_t>(timestamp))));
+}
+
+// Summary of a strategy's buckets, sent first so that identical strategies cost 8 bytes.
+inline uint64_t digest_root(const DigestBuckets& buckets) {
+    uint64_t root = 0;
+    for (uint64_t bucket : buckets) {
+        root = mix64(root ^ bucket);
+    }
+    return root;
+}
+
+inline BucketSet differing_buckets(const DigestBuckets& a, const DigestBuckets& b) {
+    BucketSet differ;
+    for (std::size_t i = 0; i < kDigestBuckets; ++i) {
+        differ[i] = a[i] != b[i];
+    }
+    return differ;
+}
+
+
+// The bucket hashes of every strategy row of one shard's PositionTable. Only the shard worker
+// touches it, like the table itself.
+class ShardDigest {
+public:
+    ShardDigest(const Interner& symbols, std::size_t max_strategies, std::size_t max_symbols):
+            symbols_(symbols),
+            keys_(max_symbols, 0),
+            buckets_(max_strategies)
+    {}
+
+    // Call with the cell's value before a change (if the cell was populated) and again after it.
+    void toggle(uint32_t strategy_id, uint32_t symbol_id, const Position& position) {
+        uint64_t key = key_of(symbol_id);
+        buckets_[strategy_id][digest_bucket(key)] ^= cell_hash(key, position.net_position, position.timestamp);
+    }
+
+    const DigestBuckets& buckets(uint32_t strategy_id) const {
+        return buckets_[strategy_id];
+    }
+
+    std::size_t bucket_of(uint32_t symbol_id) {
+        return digest_bucket(key_of(symbol_id));
+    }
+
+private:
+    uint64_t key_of(uint32_t symbol_id) {
+        uint64_t& key = keys_[symbol_id];
+        if (key == 0) {
+            key = symbol_key(symbols_.name(symbol_id));
+        }
+        return key;
+    }
+
+    const Interner& symbols_;
+    std::vector<uint64_t> keys_;
+    std::vector<DigestBuckets> buckets_;
+};
+
+#endif //MYSERVER_DIGEST_H
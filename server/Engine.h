@@ -1,207 +1,1396 @@
 #ifndef MYSERVER_ENGINE_H
 #define MYSERVER_ENGINE_H
 
+#include <algorithm>
 #include <chrono>
-#include <boost/lockfree/queue.hpp>
-#include <google/protobuf/arena.h>
+#include <deque>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <random>
 #include <google/protobuf/message.h>
 #include <google/protobuf/text_format.h>
 #include <google/protobuf/util/delimited_message_util.h>
 #include <google/protobuf/timestamp.pb.h>
 #include <memory>
+#include <string_view>
 #include <utility>
 #include <position.pb.h>
 #include <thread>
 #include <atomic>
+#include <set>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 
+#include "Digest.h"
+#include "Exposure.h"
+#include "Metrics.h"
 #include "peer.h"
+#include "PositionTable.h"
+#include "ReplayRing.h"
+#include "Shard.h"
 #include "utils.h"
 
+constexpr std::size_t kMaxStrategies = 64;
+// Symbols in the whole book. Every shard is sized for its share only, see shard_symbol_capacity.
+constexpr std::size_t kMaxSymbols = 16384;
+constexpr std::size_t kShardQueueCapacity = 8192;
+// Out of order sequence numbers remembered per strategy while waiting for the gap below them.
+constexpr std::size_t kMaxSeqsAhead = 65536;
+// Catch-up snapshots are streamed in chunks of this many positions, at most kSnapshotWindow
+// chunks ahead of the receiver's credit.
+constexpr std::size_t kSnapshotChunkPositions = 4096;
+constexpr uint32_t kSnapshotWindow = 4;
+constexpr std::chrono::seconds kSnapshotIdleTimeout{30};
+// Own sequence numbers reserved in the log at a time, so the log only syncs for them rarely.
+constexpr uint64_t kSeqReservation = 1 << 20;
+
+// A multicast gap that an earlier recovery request has not closed after this long is asked for again.
+constexpr std::chrono::seconds kGapRecoveryTimeout{1};
+constexpr std::chrono::milliseconds kMulticastHeartbeatInterval{100};
+
+
+struct EngineConfig {
+    std::size_t shard_count = 1;
+    // Number of network threads that deliver frames; each gets its own lane into every shard.
+    std::size_t network_threads = 1;
+    // Shard i is pinned to core (first_core + i) % hardware_concurrency. -1 disables pinning.
+    int first_core = -1;
+    // How shard workers wait for work and how producers wait on a full shard queue.
+    WaitStrategyType wait_strategy = WaitStrategyType::Backoff;
+    // Own position changes are broadcast as one PositionBatch per window. A zero window
+    // flushes after every pass over the shard queues.
+    std::chrono::microseconds coalesce_window{0};
+    std::size_t coalesce_max_batch = 256;
+    // Directory holding each shard's snapshot and write-ahead log. Empty disables persistence.
+    std::string data_dir;
+    // fdatasync the log once per batch of updates, and fsync every snapshot.
+    bool fsync = true;
+    std::chrono::seconds snapshot_interval{60};
+    // Every interval the engine compares digests with one random peer and exchanges only the
+    // positions that differ. Zero disables anti-entropy.
+    std::chrono::milliseconds gossip_interval{1000};
+    // Own updates kept for peers that reconnect; a peer that missed more gets a full snapshot.
+    std::size_t replay_ring_capacity = 65536;
+    // Own trades that would take firm-wide exposure past these limits are rejected.
+    ExposureLimits limits;
+};
+
+
+// One change to the book, as published on Engine::position_changed. The names point into the
+// shard interners and stay valid for the lifetime of the engine.
+struct PositionUpdate {
+    std::string_view strategy;
+    std::string_view symbol;
+    double net_position;
+    int64_t timestamp;
+};
+
+// Firm-wide exposure of one symbol, summed over every strategy.
+struct SymbolExposure {
+    std::string symbol;
+    double net;
+    double gross;
+};
+
+// One row of a query result.
+struct PositionEntry {
+    std::string strategy;
+    std::string symbol;
+    double net_position;
+    int64_t timestamp;
+    uint64_t seq;
+};
+
 
 class Engine {
 public:
-    explicit Engine(const std::shared_ptr<Peer>& peer, std::string&& strategy_name):
-            peer_(peer),
-            consume_trade_worker_([this] {consume_trades();}),
-            consume_position_worker_([this] {consume_positions();}),
+    // Fires on the shard worker thread after every change to the book, whether from a local
+    // trade or a peer update. Handlers must be quick and must not call the query functions
+    // below, which wait on the shard threads.
+    Event<const PositionUpdate&> position_changed;
+
+    explicit Engine(const std::shared_ptr<Peer>& peer, std::string&& strategy_name, const EngineConfig& config = {}):
             running_(true),
-            trades_queue_(65536),
-            positions_queue_(65536),
-            strategy_name_(std::move(strategy_name))
+            wait_strategy_(config.wait_strategy),
+            max_batch_(std::max<std::size_t>(config.coalesce_max_batch, 1)),
+            lane_count_(1 + std::max<std::size_t>(config.network_threads, 1)),
+            data_dir_(config.data_dir),
+            fsync_(config.fsync),
+            snapshot_interval_(config.snapshot_interval),
+            last_seq_(data_dir_.empty() ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count()) : 0),
+            replay_ring_(config.replay_ring_capacity),
+            peer_(peer),
+            strategy_name_(std::move(strategy_name)),
+            maintenance_work_(asio::make_work_guard(maintenance_io_)),
+            gossip_timer_(maintenance_io_),
+            heartbeat_timer_(maintenance_io_),
+            gossip_interval_(config.gossip_interval),
+            gossip_rng_(std::random_device{}())
     {
+        std::size_t shard_count = std::max<std::size_t>(config.shard_count, 1);
+        std::size_t shard_symbols = shard_symbol_capacity(kMaxSymbols, shard_count);
+        for (std::size_t i = 0; i < shard_count; ++i) {
+            shards_.push_back(std::make_unique<Shard>(i, lane_count_, kShardQueueCapacity, kMaxStrategies, shard_symbols,
+                                                      strategy_name_, config.coalesce_window, max_batch_, config.limits));
+        }
+        if (!data_dir_.empty()) {
+            recover();
+        }
+        for (auto& shard : shards_) {
+            shard->worker = std::thread([this, shard = shard.get()] { consume(*shard); });
+            if (config.first_core >= 0) {
+                pin_thread_to_core(shard->worker, config.first_core + static_cast<int>(shard->index));
+            }
+        }
+
+        maintenance_thread_ = std::thread([this] { maintenance_io_.run(); });
+        if (gossip_interval_.count() > 0) {
+            schedule_gossip();
+        }
+        if (peer_->multicast_enabled()) {
+            schedule_heartbeat();
+        }
+
         log("[Engine::Engine] Registering handlers to Peer Events for " + strategy_name_);
-        peer_->received_message += std::function<void(std::string)>(
-                [this](const std::string& msg) {
-                    incoming_message_handler(msg);
-                }
-        );
+        peer_->received_message += [this](const std::shared_ptr<Connection>& connection, const FrameView& frame) {
+            incoming_message_handler(connection, frame);
+        };
 
-        peer_->connection_accepted += std::function<void(std::shared_ptr<tcp::socket>)>(
-                [this](const std::shared_ptr<tcp::socket>& socket) {
-                    std::thread([this] (std::shared_ptr<tcp::socket> socket) {
-                        push_current_positions(socket);
-                    }, socket).detach();
-                }
-        );
+        peer_->connection_accepted += [this](const std::shared_ptr<Connection>& connection) {
+            request_catch_up(connection);
+        };
+
+        peer_->received_multicast += [this](const FrameView& frame) {
+            incoming_multicast_handler(frame);
+        };
     }
 
     ~Engine() {
         log("[Engine::Engine] Destroying " + strategy_name_);
+        // Maintenance work queries the shards, so it has to stop first.
+        maintenance_work_.reset();
+        maintenance_io_.stop();
+        maintenance_thread_.join();
         running_.store(false, std::memory_order_release);
-        consume_trade_worker_.join();
-        consume_position_worker_.join();
+        for (auto& shard : shards_) {
+            shard->data_ready.notify();
+            shard->worker.join();
+        }
+        // The workers queued their last snapshots on the way out.
+        snapshot_writer_.stop();
     }
 
     void see_positions() {
+        log(format_positions());
+    }
+
+    std::string format_positions() {
         std::string position_msg = "Current positions \n";
-        for (auto& [strategy, strategy_positions]: positions_) {
-            for (auto& [symbol, position]: strategy_positions) {
-                auto [sizing, last_updated] = position;
-                position_msg += strategy + " | ";
-                position_msg +=  symbol + " | ";
-                position_msg += std::to_string(sizing) + " | ";
-                position_msg += std::to_string(last_updated) + "\n";
+        for (const PositionEntry& entry : snapshot()) {
+            position_msg += entry.strategy + " | ";
+            position_msg += entry.symbol + " | ";
+            position_msg += std::to_string(entry.net_position) + " | ";
+            position_msg += std::to_string(entry.timestamp) + "\n";
+        }
+        return position_msg;
+    }
+
+    // Queries run on the shard worker threads, between batches of updates, so every shard's
+    // part of the result is consistent. They block until the shards answer and must not be
+    // called from a shard thread.
+    std::vector<PositionEntry> snapshot() {
+        return query(all_shards(), [](const Shard& shard, std::vector<PositionEntry>& out) {
+            const PositionTable& table = shard.table;
+            table.for_each([&](uint32_t strategy_id, uint32_t symbol_id, const Position& position) {
+                out.push_back(make_entry(table, strategy_id, symbol_id, position));
+            });
+        });
+    }
+
+    std::vector<PositionEntry> strategy_positions(const std::string& strategy) {
+        return query(all_shards(), [strategy](const Shard& shard, std::vector<PositionEntry>& out) {
+            const PositionTable& table = shard.table;
+            uint32_t strategy_id = table.strategies().find(strategy);
+            if (strategy_id == Interner::npos) return;
+            table.for_each_in_row(strategy_id, [&](uint32_t symbol_id, const Position& position) {
+                out.push_back(make_entry(table, strategy_id, symbol_id, position));
+            });
+        });
+    }
+
+    // Per-symbol firm exposure, read from the incrementally maintained aggregates.
+    std::vector<SymbolExposure> exposure() {
+        return query<SymbolExposure>(all_shards(), [](const Shard& shard, std::vector<SymbolExposure>& out) {
+            uint32_t symbol_count = shard.table.symbols().size();
+            for (uint32_t symbol_id = 0; symbol_id < symbol_count; ++symbol_id) {
+                out.push_back({shard.table.symbols().name(symbol_id), shard.exposure.symbol_net(symbol_id),
+                               shard.exposure.symbol_gross(symbol_id)});
             }
+        });
+    }
+
+    // Firm totals over every shard. Lock-free and callable from any thread; shards that are busy
+    // applying updates are read as of their last write.
+    std::pair<double, double> firm_exposure() const {
+        double net = 0, gross = 0;
+        for (const auto& shard : shards_) {
+            net += shard->exposure.net_total();
+            gross += shard->exposure.gross_total();
         }
-        log(position_msg);
+        return {net, gross};
     }
 
-    void push_trade(const Trade& trade) {
-        auto* arena_trade = google::protobuf::Arena::CreateMessage<Trade>(&arena_);
-        arena_trade->CopyFrom(trade);
+    // Recomputes every aggregate from scratch on the shard threads and returns the largest
+    // drift found, which the recomputation also corrects.
+    ShardExposure::AuditResult audit_exposure() {
+        auto parts = query<ShardExposure::AuditResult>(all_shards(), [](Shard& shard, std::vector<ShardExposure::AuditResult>& out) {
+            out.push_back(shard.exposure.audit(shard.table));
+        });
+        ShardExposure::AuditResult worst;
+        for (const auto& part : parts) {
+            worst.max_symbol_error = std::max(worst.max_symbol_error, part.max_symbol_error);
+            worst.net_error += part.net_error;
+            worst.gross_error += part.gross_error;
+        }
+        return worst;
+    }
 
-        while (!trades_queue_.push(arena_trade)) {
-            std::this_thread::yield();
+    std::string format_exposure() {
+        std::string message = "Firm exposure (symbol | net | gross)\n";
+        for (const SymbolExposure& entry : exposure()) {
+            message += entry.symbol + " | " + std::to_string(entry.net) + " | " + std::to_string(entry.gross) + "\n";
         }
+        auto [net, gross] = firm_exposure();
+        message += "firm | " + std::to_string(net) + " | " + std::to_string(gross) + "\n";
+        return message;
+    }
+
+    // Bucket hashes of every strategy with at least one position, merged across shards.
+    std::map<std::string, DigestBuckets> digests() {
+        struct StrategyBuckets {
+            std::string strategy;
+            DigestBuckets buckets;
+        };
+        auto parts = query<StrategyBuckets>(all_shards(), [](const Shard& shard, std::vector<StrategyBuckets>& out) {
+            uint32_t strategy_count = shard.table.strategies().size();
+            for (uint32_t strategy_id = 0; strategy_id < strategy_count; ++strategy_id) {
+                out.push_back({shard.table.strategies().name(strategy_id), shard.digest.buckets(strategy_id)});
+            }
+        });
+
+        std::map<std::string, DigestBuckets> merged;
+        for (const StrategyBuckets& part : parts) {
+            if (part.buckets == DigestBuckets{}) continue;
+            DigestBuckets& buckets = merged.try_emplace(part.strategy, DigestBuckets{}).first->second;
+            for (std::size_t i = 0; i < kDigestBuckets; ++i) {
+                buckets[i] ^= part.buckets[i];
+            }
+        }
+        return merged;
+    }
+
+    std::vector<PositionEntry> bucket_positions(const std::string& strategy, BucketSet buckets) {
+        return query(all_shards(), [strategy, buckets](Shard& shard, std::vector<PositionEntry>& out) {
+            const PositionTable& table = shard.table;
+            uint32_t strategy_id = table.strategies().find(strategy);
+            if (strategy_id == Interner::npos) return;
+            table.for_each_in_row(strategy_id, [&](uint32_t symbol_id, const Position& position) {
+                if (buckets[shard.digest.bucket_of(symbol_id)]) {
+                    out.push_back(make_entry(table, strategy_id, symbol_id, position));
+                }
+            });
+        });
+    }
+
+    // Only asks the shard that owns the symbol.
+    std::vector<PositionEntry> symbol_positions(const std::string& symbol) {
+        return query({&shard_for(symbol)}, [symbol](const Shard& shard, std::vector<PositionEntry>& out) {
+            const PositionTable& table = shard.table;
+            uint32_t symbol_id = table.symbols().find(symbol);
+            if (symbol_id == Interner::npos) return;
+            uint32_t strategy_count = table.strategies().size();
+            for (uint32_t strategy_id = 0; strategy_id < strategy_count; ++strategy_id) {
+                const Position& position = table.at(strategy_id, symbol_id);
+                if (position.timestamp != 0) {
+                    out.push_back(make_entry(table, strategy_id, symbol_id, position));
+                }
+            }
+        });
+    }
+
+    // Safe to call from the network threads and from one other thread (the trade ingress thread),
+    // each of which pushes through its own lane.
+    void push_trade(const Trade& trade) {
+        Shard& shard = shard_for(trade.symbol());
+        push(shard, *shard.trade_lanes[current_lane()], trade);
     }
 
     void push_position(const SymbolPos& pos) {
-        auto* arena_position = google::protobuf::Arena::CreateMessage<SymbolPos>(&arena_);
-        arena_position->CopyFrom(pos);
+        Shard& shard = shard_for(pos.symbol());
+        push(shard, *shard.position_lanes[current_lane()], pos);
+    }
 
-        while (!positions_queue_.push(arena_position)) {
-            std::this_thread::yield();
+    // Reads the counters the producers and shard workers keep; never waits on them.
+    void write_metrics(MetricsWriter& out) const {
+        auto for_each_lane = [this](auto&& f) {
+            for (const auto& shard : shards_) {
+                std::string shard_label = std::to_string(shard->index);
+                for (std::size_t lane = 0; lane < lane_count_; ++lane) {
+                    std::string lane_label = std::to_string(lane);
+                    f(shard_label, lane_label, "trade", *shard->trade_lanes[lane]);
+                    f(shard_label, lane_label, "position", *shard->position_lanes[lane]);
+                }
+            }
+        };
+
+        out.family("distributor_shard_queue_depth", "gauge", "Messages queued in a shard lane and not yet processed.");
+        for_each_lane([&](const std::string& shard, const std::string& lane, const char* queue, const auto& l) {
+            out.sample("distributor_shard_queue_depth", {{"shard", shard}, {"queue", queue}, {"lane", lane}},
+                       static_cast<double>(l.depth()));
+        });
+        out.family("distributor_shard_enqueued_total", "counter", "Messages pushed into a shard lane.");
+        for_each_lane([&](const std::string& shard, const std::string& lane, const char* queue, const auto& l) {
+            out.sample("distributor_shard_enqueued_total", {{"shard", shard}, {"queue", queue}, {"lane", lane}},
+                       static_cast<double>(l.enqueued.value()));
+        });
+        out.family("distributor_shard_full_queue_waits_total", "counter",
+                   "Times a producer waited for space because a shard lane was full.");
+        for_each_lane([&](const std::string& shard, const std::string& lane, const char* queue, const auto& l) {
+            out.sample("distributor_shard_full_queue_waits_total", {{"shard", shard}, {"queue", queue}, {"lane", lane}},
+                       static_cast<double>(l.full_waits.value()));
+        });
+
+        out.family("distributor_shard_queue_latency_seconds", "histogram",
+                   "Time from a message being queued to a shard until the shard finished processing it.");
+        for (const auto& shard : shards_) {
+            std::string shard_label = std::to_string(shard->index);
+            out.histogram("distributor_shard_queue_latency_seconds", {{"shard", shard_label}, {"queue", "trade"}},
+                          shard->trade_latency);
+            out.histogram("distributor_shard_queue_latency_seconds", {{"shard", shard_label}, {"queue", "position"}},
+                          shard->position_latency);
+        }
+
+        auto [firm_net, firm_gross] = firm_exposure();
+        out.family("distributor_firm_net_position", "gauge", "Net position summed over every strategy and symbol.");
+        out.sample("distributor_firm_net_position", {}, firm_net);
+        out.family("distributor_firm_gross_position", "gauge", "Absolute positions summed over every strategy and symbol.");
+        out.sample("distributor_firm_gross_position", {}, firm_gross);
+        out.family("distributor_rejected_trades_total", "counter", "Own trades rejected by a pre-trade exposure limit.");
+        for (std::size_t kind = 1; kind < kLimitCheckKinds; ++kind) {
+            uint64_t rejected = 0;
+            for (const auto& shard : shards_) {
+                rejected += shard->rejected_trades[kind].value();
+            }
+            out.sample("distributor_rejected_trades_total", {{"limit", to_string(static_cast<LimitCheck>(kind))}},
+                       static_cast<double>(rejected));
+        }
+
+        out.family("distributor_shard_broadcasts_total", "counter", "PositionBatch frames broadcast by a shard.");
+        for (const auto& shard : shards_) {
+            out.sample("distributor_shard_broadcasts_total", {{"shard", std::to_string(shard->index)}},
+                       static_cast<double>(shard->broadcasts.value()));
+        }
+
+        if (peer_->multicast_enabled()) {
+            out.family("distributor_multicast_gap_recoveries_total", "counter",
+                       "Catch-up requests sent to a peer after a gap in its multicast updates.");
+            out.sample("distributor_multicast_gap_recoveries_total", {},
+                       static_cast<double>(gap_recoveries_.load(std::memory_order_relaxed)));
         }
     }
 
 private:
-    boost::lockfree::queue<Trade*> trades_queue_;
-    boost::lockfree::queue<SymbolPos*> positions_queue_;
-    google::protobuf::Arena arena_;
+    // bench/engine_bench.cpp drives the shard internals directly.
+    friend class EngineBench;
+
     std::atomic<bool> running_;
-    std::thread consume_trade_worker_;
-    std::thread consume_position_worker_;
+    WaitStrategy wait_strategy_;
+    std::size_t max_batch_;
+    std::size_t lane_count_;
+    std::string data_dir_;
+    bool fsync_;
+    std::chrono::seconds snapshot_interval_;
+    SnapshotWriter snapshot_writer_;
+
+    // Own updates are numbered and broadcast under publish_mutex_, so every connection receives
+    // them in sequence order. A restarted engine has to stay ahead of the numbers it used before:
+    // with --data-dir, numbers are reserved kSeqReservation at a time in the log and every
+    // snapshot records the reservation, so recovery resumes after it. Without persistence there
+    // is nothing to resume from, and last_seq_ starts at the wall clock in ns instead.
+    std::mutex publish_mutex_;
+    uint64_t last_seq_;
+    uint64_t seq_reserved_ = 0;
+    ReplayRing replay_ring_;
+
+    // How far each peer strategy's updates have been received without gaps.
+    struct StreamState {
+        uint64_t through = 0;
+        std::set<uint64_t> ahead;
+        // A catch-up was requested to fill a multicast gap and has not finished yet.
+        bool recovering = false;
+        std::chrono::steady_clock::time_point recovery_requested;
+    };
+    std::mutex streams_mutex_;
+    std::unordered_map<std::string, StreamState> streams_;
+    // The connection each strategy was last caught up from, its owner's or a relay's, guarded by streams_mutex_.
+    std::unordered_map<std::string, std::weak_ptr<Connection>> owners_;
+    std::atomic<uint64_t> gap_recoveries_{0};
+
+    // Catch-up snapshots being streamed, one transfer per connection with one part per strategy,
+    // sent one after the other under a shared credit. Only touched on the maintenance thread.
+    struct SnapshotPart {
+        uint64_t id;
+        std::string strategy;
+        uint64_t through_seq;
+        std::vector<PositionEntry> entries;
+        std::size_t next = 0;
+        uint32_t chunk = 0;
+    };
+    struct SnapshotTransfer {
+        std::shared_ptr<Connection> connection;
+        std::deque<SnapshotPart> parts;
+        uint64_t first_id = 0;   // credit for older snapshot ids belongs to an earlier transfer
+        uint32_t credit = 0;
+        std::chrono::steady_clock::time_point last_activity;
+    };
+    std::unordered_map<Connection*, SnapshotTransfer> transfers_;
+    uint64_t next_snapshot_id_ = 1;
+
+    std::vector<std::unique_ptr<Shard>> shards_;
     std::shared_ptr<Peer> peer_;
-    std::unordered_map<std::string, std::unordered_map<std::string, std::pair<double, int64_t>>> positions_;
     std::string strategy_name_;
+
+    // Runs work that waits on the shards, such as anti-entropy rounds, off the network threads.
+    asio::io_context maintenance_io_;
+    asio::executor_work_guard<asio::io_context::executor_type> maintenance_work_;
+    asio::steady_timer gossip_timer_;
+    asio::steady_timer heartbeat_timer_;
+    std::chrono::milliseconds gossip_interval_;
+    std::mt19937 gossip_rng_;
+    std::thread maintenance_thread_;
 private:
-    void incoming_message_handler(const std::string& msg) {
+    Shard& shard_for(std::string_view symbol) {
+        return *shards_[std::hash<std::string_view>{}(symbol) % shards_.size()];
+    }
+
+    std::vector<Shard*> all_shards() const {
+        std::vector<Shard*> shards;
+        for (auto& shard : shards_) {
+            shards.push_back(shard.get());
+        }
+        return shards;
+    }
+
+    static PositionEntry make_entry(const PositionTable& table, uint32_t strategy_id, uint32_t symbol_id,
+                                    const Position& position) {
+        return PositionEntry{table.strategies().name(strategy_id), table.symbols().name(symbol_id),
+                             position.net_position, position.timestamp, position.seq};
+    }
+
+    // Runs visit(shard, out) on the worker thread of every target shard and concatenates the results.
+    template<typename T = PositionEntry, typename F>
+    std::vector<T> query(const std::vector<Shard*>& targets, F visit) {
+        std::vector<std::future<std::vector<T>>> parts;
+        for (Shard* shard : targets) {
+            auto task = std::make_shared<std::packaged_task<std::vector<T>()>>([shard, visit] {
+                std::vector<T> out;
+                visit(*shard, out);
+                return out;
+            });
+            parts.push_back(task->get_future());
+            post(*shard, [task] { (*task)(); });
+        }
+
+        std::vector<T> result;
+        for (auto& part : parts) {
+            std::vector<T> entries = part.get();
+            result.insert(result.end(), std::make_move_iterator(entries.begin()), std::make_move_iterator(entries.end()));
+        }
+        return result;
+    }
+
+    void post(Shard& shard, std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(shard.tasks_mutex);
+            shard.tasks.push_back(std::move(task));
+            shard.has_tasks.store(true, std::memory_order_release);
+        }
+        wait_strategy_.notify(shard.data_ready);
+    }
+
+    std::size_t run_tasks(Shard& shard) {
+        if (!shard.has_tasks.load(std::memory_order_acquire)) return 0;
+        std::vector<std::function<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(shard.tasks_mutex);
+            tasks.swap(shard.tasks);
+            shard.has_tasks.store(false, std::memory_order_relaxed);
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+        return tasks.size();
+    }
+
+    void publish(Shard& shard, JournalKind kind, uint32_t strategy_id, uint32_t symbol_id, const Position& position) {
+        const PositionTable& table = shard.table;
+        PositionUpdate update{table.strategies().name(strategy_id), table.symbols().name(symbol_id),
+                              position.net_position, position.timestamp};
+        if (shard.wal) {
+            shard.wal->append(JournalRecord{kind, update.strategy, update.symbol, update.net_position, update.timestamp});
+        }
+        LOG_DEBUG("[Engine::publish] " + std::string(update.strategy) + " | " + std::string(update.symbol) + " | "
+                  + std::to_string(update.net_position) + " | " + std::to_string(update.timestamp));
+        position_changed(update);
+    }
+
+    // Lane 0 for the trade ingress thread, lane i + 1 for network thread i.
+    std::size_t current_lane() const {
+        int io_index = IoContextPool::current_index();
+        return io_index < 0 ? 0 : 1 + static_cast<std::size_t>(io_index) % (lane_count_ - 1);
+    }
+
+    template<typename T>
+    void push(Shard& shard, Lane<T>& lane, const T& msg) {
+        uint32_t slot;
+        unsigned spins = 0;
+        while (true) {
+            uint32_t epoch = shard.space_ready.epoch();
+            if (lane.pool.try_acquire(slot)) break;
+            lane.full_waits.add();
+            wait_strategy_.wait(shard.space_ready, epoch, spins);
+        }
+        lane.pool[slot].CopyFrom(msg);
+        lane.enqueued_at[slot] = metrics::now_ns();
+        // Cannot fail while the queue is twice the pool; if it ever does, wait for the worker
+        // rather than lose the message.
+        while (!lane.queue.push(slot)) {
+            lane.full_waits.add();
+            std::this_thread::yield();
+        }
+        lane.enqueued.add();
+        wait_strategy_.notify(shard.data_ready);
+    }
+
+    // Parses the payload once, straight out of the Peer receive buffer. The scratch messages are
+    // thread_local so their allocations are reused across frames.
+    void incoming_message_handler(const std::shared_ptr<Connection>& connection, const FrameView& frame) {
+        thread_local PositionBatch batch;
+        thread_local PositionSnapshot snapshot_chunk;
+        thread_local SymbolPos pos;
+        thread_local Trade trade;
+
+        const int size = static_cast<int>(frame.size);
+        switch (frame.type) {
+            case MessageType::PositionBatch:
+                if (!batch.ParseFromArray(frame.data, size)) break;
+                LOG_DEBUG("[Engine::incoming_message_handler] Received PositionBatch message:\n" + debug_string(batch));
+                for (const auto& batch_pos : batch.positions()) {
+                    push_position(batch_pos);
+                }
+                note_received(batch);
+                return;
+            case MessageType::PositionSnapshot:
+                if (!snapshot_chunk.ParseFromArray(frame.data, size)) break;
+                receive_snapshot_chunk(connection, snapshot_chunk);
+                return;
+            case MessageType::SymbolPos:
+                if (!pos.ParseFromArray(frame.data, size)) break;
+                LOG_DEBUG("[Engine::incoming_message_handler] Received SymPos message:\n" + debug_string(pos));
+                push_position(pos);
+                return;
+            case MessageType::Trade:
+                if (!trade.ParseFromArray(frame.data, size)) break;
+                LOG_DEBUG("[Engine::incoming_message_handler] Received Trade message:\n" + debug_string(trade));
+                push_trade(trade);
+                return;
+            case MessageType::Digest: {
+                auto digest = std::make_shared<Digest>();
+                if (!digest->ParseFromArray(frame.data, size)) break;
+                asio::post(maintenance_io_, [this, connection, digest] { handle_digest(connection, *digest); });
+                return;
+            }
+            case MessageType::BucketRequest: {
+                auto request = std::make_shared<BucketRequest>();
+                if (!request->ParseFromArray(frame.data, size)) break;
+                asio::post(maintenance_io_, [this, connection, request] { handle_bucket_request(connection, *request); });
+                return;
+            }
+            case MessageType::CatchUpRequest: {
+                auto request = std::make_shared<CatchUpRequest>();
+                if (!request->ParseFromArray(frame.data, size)) break;
+                asio::post(maintenance_io_, [this, connection, request] { handle_catch_up(connection, *request); });
+                return;
+            }
+            case MessageType::SnapshotCredit: {
+                SnapshotCredit credit;
+                if (!credit.ParseFromArray(frame.data, size)) break;
+                asio::post(maintenance_io_, [this, connection, credit] { handle_snapshot_credit(connection, credit); });
+                return;
+            }
+            case MessageType::ShmOffer:
+            case MessageType::ShmAccept:
+            case MessageType::ShmReady:
+            case MessageType::ShmDoorbell:
+            case MessageType::PeerHello:
+                return;   // transport control, consumed by Peer
+            case MessageType::Join:
+            case MessageType::Membership:
+                return;   // registry traffic, never sent between peers
+        }
+        log("[Engine::incoming_message_handler] Could not parse " + to_string(frame.type) + " message, dropping", true);
+    }
+
+    // Only broadcasts travel on the multicast group. Each datagram holds one PositionBatch of its
+    // owner's strategy; this engine's own datagrams loop back and are skipped.
+    void incoming_multicast_handler(const FrameView& frame) {
+        thread_local PositionBatch batch;
+        if (frame.type != MessageType::PositionBatch || !batch.ParseFromArray(frame.data, static_cast<int>(frame.size))) {
+            log("[Engine::incoming_multicast_handler] Dropping " + to_string(frame.type) + " datagram", true);
+            return;
+        }
+        const std::string& strategy = batch.positions_size() > 0 ? batch.positions(0).strategy_name() : batch.strategy_name();
+        if (strategy.empty() || strategy == strategy_name_) return;
+        for (const auto& batch_pos : batch.positions()) {
+            push_position(batch_pos);
+        }
+        recover_gaps(strategy, batch);
+    }
+
+    // Announces the last own seq on the group, see PositionBatch.last_seq.
+    void schedule_heartbeat() {
+        heartbeat_timer_.expires_after(kMulticastHeartbeatInterval);
+        heartbeat_timer_.async_wait([this](const boost::system::error_code& ec) {
+            if (ec) return;
+            PositionBatch heartbeat;
+            heartbeat.set_strategy_name(strategy_name_);
+            std::lock_guard<std::mutex> lock(publish_mutex_);
+            heartbeat.set_last_seq(last_seq_);
+            SharedFrame frame = make_frame(MessageType::PositionBatch, heartbeat);
+            if (frame) peer_->multicast(frame);
+            schedule_heartbeat();
+        });
+    }
+
+    // Gap detection for multicast. Sequence numbers of a strategy are consecutive, so a batch
+    // that leaves seqs ahead of the contiguous prefix means datagrams were lost (or reordered).
+    // The owner is asked over TCP for everything after the prefix, which it answers from its
+    // replay ring, or with a snapshot, through the usual catch-up stream. Heartbeats reveal
+    // the loss of the last datagrams before a pause.
+    void recover_gaps(const std::string& strategy, const PositionBatch& batch) {
+        std::shared_ptr<Connection> owner;
+        uint64_t through;
+        {
+            std::lock_guard<std::mutex> lock(streams_mutex_);
+            for (const SymbolPos& pos : batch.positions()) {
+                note_seq(pos.strategy_name(), pos.seq());
+            }
+            note_seq(strategy, batch.last_seq());
+            StreamState& stream = streams_[strategy];
+            auto now = std::chrono::steady_clock::now();
+            if (stream.ahead.empty() || (stream.recovering && now - stream.recovery_requested < kGapRecoveryTimeout)) return;
+            auto it = owners_.find(strategy);
+            if (it == owners_.end() || !(owner = it->second.lock())) return;
+            stream.recovering = true;
+            stream.recovery_requested = now;
+            through = stream.through;
+        }
+        gap_recoveries_.fetch_add(1, std::memory_order_relaxed);
+        log("[Engine::recover_gaps] Missed multicast updates of " + strategy + " after seq " + std::to_string(through)
+            + ", requesting them from " + owner->name);
+        request_catch_up(owner);
+    }
+
+    static std::string debug_string(const google::protobuf::Message& message) {
         std::string message_str;
-        Trade trade;
-        SymbolPos pos;
-        if (pos.ParseFromString(msg)) {
-            google::protobuf::TextFormat::PrintToString(pos, &message_str);
-            log("[Engine::incoming_message_handler] Received SymPos message:\n" + message_str);
-            push_position(pos);
-        } else if (trade.ParseFromString(msg)) {
-            google::protobuf::TextFormat::PrintToString(trade, &message_str);
-            log("[Engine::incoming_message_handler] Received Trade message:\n" + message_str);
-            push_trade(trade);
-        } else {
-            log("[Engine::incoming_message_handler] Could not parse protobuf message, dropping", true);
+        google::protobuf::TextFormat::PrintToString(message, &message_str);
+        return message_str;
+    }
+
+    // Reconnect catch-up. Both ends of a new connection send the sequence number up to which
+    // they hold every update of each strategy. The owner answers with only the updates after
+    // it, taken from its replay ring and reduced to the latest per symbol, or with a full
+    // snapshot when the gap is no longer in the ring. Either answer is streamed as
+    // PositionSnapshot chunks, each acknowledged with one chunk of credit by the receiver.
+    //
+    // A relay also answers for every other strategy the requester is behind on, since members
+    // behind a relay only hear from the other owners through it. It keeps no replay ring for
+    // them, so those go out as full snapshots, versioned with the relay's own gapless seq.
+    void request_catch_up(const std::shared_ptr<Connection>& connection) {
+        CatchUpRequest request;
+        {
+            std::lock_guard<std::mutex> lock(streams_mutex_);
+            for (const auto& [strategy, stream] : streams_) {
+                StreamPosition* position = request.add_streams();
+                position->set_strategy_name(strategy);
+                position->set_seq(stream.through);
+            }
         }
+        request.set_snapshot_credit(kSnapshotWindow);
+        request.set_strategy_name(strategy_name_);
+        send(connection, MessageType::CatchUpRequest, request);
     }
 
-    void push_current_positions(std::shared_ptr<tcp::socket>& socket) {
-        log("[Engine::push_current_positions] Sending " + strategy_name_ + \
-            " positions to " + Peer::get_host_port_str(socket->remote_endpoint()));
-        for (auto& [symbol, position] : positions_[strategy_name_]) {
-            auto [sizing, last_updated] = position;
-            SymbolPos pos;
-            pos.set_strategy_name(strategy_name_);
-            pos.set_symbol(symbol);
-            pos.set_net_position(sizing);
-            pos.set_timestamp(last_updated);
+    void handle_catch_up(const std::shared_ptr<Connection>& connection, const CatchUpRequest& request) {
+        uint64_t after = 0;
+        std::unordered_map<std::string, uint64_t> requester_through;
+        for (const StreamPosition& stream : request.streams()) {
+            if (stream.strategy_name() == strategy_name_) after = stream.seq();
+            requester_through[stream.strategy_name()] = stream.seq();
+        }
 
-            std::string position_msg;
-            if (!pos.SerializeToString(&position_msg)) {
-                log("[Engine::push_current_positions] Failed to serialize protobuf message. Skipping sending position...", true);
-                continue;
+        std::vector<PositionEntry> entries;
+        uint64_t through;
+        bool replay;
+        {
+            std::lock_guard<std::mutex> lock(publish_mutex_);
+            through = last_seq_;
+            replay = after != 0 && after <= through && (after == through || replay_ring_.covers(after));
+            if (replay) {
+                std::unordered_set<uint64_t> seen;
+                replay_ring_.for_each_after(after, [&](const ReplayRing::Entry& entry) {
+                    if (!seen.insert(static_cast<uint64_t>(entry.shard) << 32 | entry.symbol_id).second) return;
+                    entries.push_back(PositionEntry{strategy_name_, shards_[entry.shard]->table.symbols().name(entry.symbol_id),
+                                                    entry.net_position, entry.timestamp, entry.seq});
+                });
             }
-            peer_->send_message(socket, position_msg);
         }
+
+        if (replay) {
+            log("[Engine::handle_catch_up] Sending " + std::to_string(entries.size()) + " positions updated after seq "
+                + std::to_string(after) + " to " + connection->name);
+        } else {
+            // Read after through was taken, so the snapshot holds every update up to it.
+            entries = strategy_positions(strategy_name_);
+            log("[Engine::handle_catch_up] Updates after seq " + std::to_string(after) + " are not all in the replay ring, sending snapshot of "
+                + std::to_string(entries.size()) + " positions to " + connection->name);
+        }
+
+        // The entries are a private copy, so the engine keeps running while they are streamed.
+        expire_transfers();
+        SnapshotTransfer& transfer = transfers_[connection.get()];
+        transfer = SnapshotTransfer{
+                .connection = connection,
+                .parts = {},
+                .first_id = next_snapshot_id_,
+                .credit = std::max<uint32_t>(request.snapshot_credit(), 1),
+                .last_activity = std::chrono::steady_clock::now(),
+        };
+        transfer.parts.push_back(SnapshotPart{next_snapshot_id_++, strategy_name_, through, std::move(entries)});
+        if (peer_->relay()) {
+            relayed_snapshot_parts(request.strategy_name(), requester_through, transfer);
+        }
+        pump_transfer(transfer);
     }
 
-    void process_positions(SymbolPos& pos) {
-        log("[Engine::process_positions] Processing position " + pos.symbol() + " from " + pos.strategy_name());
-        if (positions_.find(pos.strategy_name()) == positions_.end() || \
-            positions_[pos.strategy_name()].find(pos.symbol()) == positions_[pos.strategy_name()].end())
+    // Adds a part for every strategy of another owner that this relay holds further than the
+    // requester does. Each through is read before the positions, like for an own snapshot.
+    void relayed_snapshot_parts(const std::string& requester, const std::unordered_map<std::string, uint64_t>& requester_through,
+                                SnapshotTransfer& transfer) {
+        std::vector<std::pair<std::string, uint64_t>> behind;
         {
-            positions_[pos.strategy_name()][pos.symbol()].first = pos.net_position();
-            positions_[pos.strategy_name()][pos.symbol()].second = pos.timestamp();
-            see_positions();
+            std::lock_guard<std::mutex> lock(streams_mutex_);
+            for (const auto& [strategy, stream] : streams_) {
+                auto it = requester_through.find(strategy);
+                if (strategy != requester && stream.through > (it == requester_through.end() ? 0 : it->second)) {
+                    behind.emplace_back(strategy, stream.through);
+                }
+            }
+        }
+        std::size_t positions = 0;
+        for (auto& [strategy, through] : behind) {
+            std::vector<PositionEntry> entries = strategy_positions(strategy);
+            positions += entries.size();
+            transfer.parts.push_back(SnapshotPart{next_snapshot_id_++, strategy, through, std::move(entries)});
+        }
+        if (!behind.empty()) {
+            log("[Engine::relayed_snapshot_parts] Relaying snapshots of " + std::to_string(behind.size()) + " other strategies ("
+                + std::to_string(positions) + " positions) to " + transfer.connection->name);
+        }
+    }
+
+    void handle_snapshot_credit(const std::shared_ptr<Connection>& connection, const SnapshotCredit& credit) {
+        auto it = transfers_.find(connection.get());
+        if (it == transfers_.end() || credit.snapshot_id() < it->second.first_id) return;
+        it->second.credit += credit.chunks();
+        it->second.last_activity = std::chrono::steady_clock::now();
+        pump_transfer(it->second);
+    }
+
+    // Sends chunks while there is credit. The last chunk of a part is always sent, even when
+    // empty, so the receiver learns through_seq.
+    void pump_transfer(SnapshotTransfer& transfer) {
+        PositionSnapshot chunk;
+        while (transfer.credit > 0) {
+            SnapshotPart& part = transfer.parts.front();
+            chunk.Clear();
+            chunk.set_snapshot_id(part.id);
+            chunk.set_strategy_name(part.strategy);
+            chunk.set_through_seq(part.through_seq);
+            chunk.set_chunk(part.chunk++);
+            std::size_t end = std::min(part.entries.size(), part.next + kSnapshotChunkPositions);
+            for (; part.next < end; ++part.next) {
+                const PositionEntry& entry = part.entries[part.next];
+                SymbolPos* pos = chunk.add_positions();
+                pos->set_symbol(entry.symbol);
+                pos->set_net_position(entry.net_position);
+                pos->set_timestamp(entry.timestamp);
+                pos->set_seq(entry.seq);
+            }
+            chunk.set_last(part.next == part.entries.size());
+            send(transfer.connection, MessageType::PositionSnapshot, chunk);
+            --transfer.credit;
+            if (chunk.last()) {
+                LOG_DEBUG("[Engine::pump_transfer] Finished snapshot " + std::to_string(part.id) + " of " + part.strategy
+                          + " to " + transfer.connection->name);
+                transfer.parts.pop_front();
+                if (transfer.parts.empty()) {
+                    transfers_.erase(transfer.connection.get());
+                    return;
+                }
+            }
+        }
+    }
+
+    // Drops transfers whose receiver stopped granting credit, e.g. because it disconnected.
+    void expire_transfers() {
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = transfers_.begin(); it != transfers_.end();) {
+            if (now - it->second.last_activity > kSnapshotIdleTimeout) {
+                log("[Engine::expire_transfers] Abandoning snapshot to " + it->second.connection->name, true);
+                it = transfers_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // Runs on the network thread. Pushing into the shards waits when their queues are full, so
+    // credit is only returned once the chunk has been handed to the engine. The last chunk of a
+    // part is credited too, for the parts that follow it.
+    void receive_snapshot_chunk(const std::shared_ptr<Connection>& connection, const PositionSnapshot& chunk) {
+        thread_local SymbolPos pos;
+        for (const SymbolPos& entry : chunk.positions()) {
+            pos.CopyFrom(entry);
+            pos.set_strategy_name(chunk.strategy_name());
+            push_position(pos);
+        }
+        note_received(chunk);
+        if (chunk.last()) {
+            {
+                std::lock_guard<std::mutex> lock(streams_mutex_);
+                owners_[chunk.strategy_name()] = connection;
+            }
+            log("[Engine::receive_snapshot_chunk] Caught up with " + chunk.strategy_name() + " through seq "
+                + std::to_string(chunk.through_seq()) + " in " + std::to_string(chunk.chunk() + 1) + " chunks");
+        }
+        SnapshotCredit credit;
+        credit.set_snapshot_id(chunk.snapshot_id());
+        credit.set_chunks(1);
+        send(connection, MessageType::SnapshotCredit, credit);
+    }
+
+    // Called on the network thread that received the batch. Any received update counts, since the
+    // table only ever moves forward.
+    void note_received(const PositionBatch& batch) {
+        std::lock_guard<std::mutex> lock(streams_mutex_);
+        for (const SymbolPos& pos : batch.positions()) {
+            note_seq(pos.strategy_name(), pos.seq());
+        }
+    }
+
+    void note_received(const PositionSnapshot& chunk) {
+        if (chunk.strategy_name() == strategy_name_) return;
+        std::lock_guard<std::mutex> lock(streams_mutex_);
+        for (const SymbolPos& pos : chunk.positions()) {
+            note_seq(chunk.strategy_name(), pos.seq());
+        }
+        if (chunk.last()) {
+            StreamState& stream = streams_[chunk.strategy_name()];
+            stream.through = std::max(stream.through, chunk.through_seq());
+            stream.recovering = false;
+            advance(stream);
+        }
+    }
+
+    // Must hold streams_mutex_.
+    void note_seq(const std::string& strategy, uint64_t seq) {
+        if (seq == 0 || strategy == strategy_name_) return;
+        StreamState& stream = streams_[strategy];
+        if (seq <= stream.through) return;
+        if (stream.ahead.size() >= kMaxSeqsAhead) stream.ahead.clear();
+        stream.ahead.insert(seq);
+        advance(stream);
+    }
+
+    static void advance(StreamState& stream) {
+        while (!stream.ahead.empty() && *stream.ahead.begin() <= stream.through + 1) {
+            stream.through = std::max(stream.through, *stream.ahead.begin());
+            stream.ahead.erase(stream.ahead.begin());
+        }
+    }
+
+    // Sent in batches of at most max_batch_ positions so the receiver's buffers do not overflow.
+    void send_positions(const std::shared_ptr<Connection>& connection, const std::vector<PositionEntry>& entries) {
+        PositionBatch batch;
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            const PositionEntry& entry = entries[i];
+            SymbolPos* pos = batch.add_positions();
+            pos->set_strategy_name(entry.strategy);
+            pos->set_symbol(entry.symbol);
+            pos->set_net_position(entry.net_position);
+            pos->set_timestamp(entry.timestamp);
+            pos->set_seq(entry.seq);
+            if (static_cast<std::size_t>(batch.positions_size()) >= max_batch_ || i + 1 == entries.size()) {
+                send(connection, MessageType::PositionBatch, batch);
+                batch.Clear();
+            }
+        }
+    }
+
+    void send(const std::shared_ptr<Connection>& connection, MessageType type, const google::protobuf::MessageLite& message) {
+        SharedFrame frame = make_frame(type, message);
+        if (!frame) {
+            log("[Engine::send] Failed to serialize " + to_string(type) + " message for " + connection->name, true);
+            return;
+        }
+        peer_->send_message(connection, frame);
+    }
+
+    // Anti-entropy. Every gossip_interval_ the engine sends the root hash of each strategy to one
+    // random peer. The peer answers with the bucket hashes of the strategies whose roots differ,
+    // and for every differing bucket this engine pushes its own positions and requests the
+    // peer's. Last writer wins on both sides, so after one round both hold the newer value of
+    // every cell that differed, and a round between identical books costs one small frame.
+    void schedule_gossip() {
+        gossip_timer_.expires_after(gossip_interval_);
+        gossip_timer_.async_wait([this](const boost::system::error_code& ec) {
+            if (ec) return;
+            gossip_round();
+            schedule_gossip();
+        });
+    }
+
+    void gossip_round() {
+        auto connections = peer_->connections();
+        if (connections.empty()) return;
+        const auto& connection = connections[gossip_rng_() % connections.size()];
+
+        Digest summary;
+        for (const auto& [strategy, buckets] : digests()) {
+            StrategyDigest* digest = summary.add_strategies();
+            digest->set_strategy_name(strategy);
+            digest->set_root(digest_root(buckets));
+        }
+        LOG_DEBUG("[Engine::gossip_round] Sending digest of " + std::to_string(summary.strategies_size()) + " strategies to " + connection->name);
+        send(connection, MessageType::Digest, summary);
+    }
+
+    void handle_digest(const std::shared_ptr<Connection>& connection, const Digest& remote) {
+        std::map<std::string, DigestBuckets> local = digests();
+        if (!remote.detailed()) {
+            // A strategy one side has never seen has all zero buckets on that side.
+            std::map<std::string, uint64_t> remote_roots;
+            for (const StrategyDigest& digest : remote.strategies()) {
+                remote_roots[digest.strategy_name()] = digest.root();
+            }
+            const uint64_t empty_root = digest_root(DigestBuckets{});
+            for (const auto& [strategy, _] : remote_roots) {
+                local.try_emplace(strategy, DigestBuckets{});
+            }
+
+            Digest reply;
+            reply.set_detailed(true);
+            for (const auto& [strategy, buckets] : local) {
+                auto remote_root = remote_roots.find(strategy);
+                uint64_t root = remote_root == remote_roots.end() ? empty_root : remote_root->second;
+                if (root == digest_root(buckets)) continue;
+                StrategyDigest* digest = reply.add_strategies();
+                digest->set_strategy_name(strategy);
+                digest->set_root(digest_root(buckets));
+                for (uint64_t bucket : buckets) {
+                    digest->add_buckets(bucket);
+                }
+            }
+            if (reply.strategies_size() > 0) {
+                LOG_DEBUG("[Engine::handle_digest] " + std::to_string(reply.strategies_size()) + " strategies differ from " + connection->name);
+                send(connection, MessageType::Digest, reply);
+            }
+            return;
+        }
+
+        for (const StrategyDigest& digest : remote.strategies()) {
+            if (digest.buckets_size() != static_cast<int>(kDigestBuckets)) continue;
+            DigestBuckets remote_buckets{};
+            std::copy(digest.buckets().begin(), digest.buckets().end(), remote_buckets.begin());
+            auto it = local.find(digest.strategy_name());
+            BucketSet differ = differing_buckets(it == local.end() ? DigestBuckets{} : it->second, remote_buckets);
+            if (differ.none()) continue;
+
+            std::vector<PositionEntry> entries = bucket_positions(digest.strategy_name(), differ);
+            LOG_DEBUG("[Engine::handle_digest] " + digest.strategy_name() + " differs from " + connection->name + " in "
+                      + std::to_string(differ.count()) + " buckets, pushing " + std::to_string(entries.size()) + " positions");
+            send_positions(connection, entries);
+
+            BucketRequest request;
+            request.set_strategy_name(digest.strategy_name());
+            for (std::size_t i = 0; i < kDigestBuckets; ++i) {
+                if (differ[i]) request.add_buckets(static_cast<uint32_t>(i));
+            }
+            send(connection, MessageType::BucketRequest, request);
+        }
+    }
+
+    void handle_bucket_request(const std::shared_ptr<Connection>& connection, const BucketRequest& request) {
+        BucketSet buckets;
+        for (uint32_t bucket : request.buckets()) {
+            if (bucket < kDigestBuckets) buckets.set(bucket);
+        }
+        std::vector<PositionEntry> entries = bucket_positions(request.strategy_name(), buckets);
+        LOG_DEBUG("[Engine::handle_bucket_request] Sending " + std::to_string(entries.size()) + " " + request.strategy_name()
+                  + " positions to " + connection->name);
+        send_positions(connection, entries);
+    }
+
+    void process_positions(Shard& shard, SymbolPos& pos) {
+        LOG_DEBUG("[Engine::process_positions] Processing position " + pos.symbol() + " from " + pos.strategy_name());
+        uint32_t strategy_id = shard.table.strategies().intern(pos.strategy_name());
+        uint32_t symbol_id = shard.table.symbols().intern(pos.symbol());
+        if (strategy_id == Interner::npos || symbol_id == Interner::npos) {
+            log("[Engine::process_positions] Position table full, dropping " + pos.symbol() + " from " + pos.strategy_name(), true);
             return;
         }
 
-        auto& [current_pos, timestamp] = positions_[pos.strategy_name()][pos.symbol()];
-        if (pos.timestamp() > timestamp) {
-            current_pos = pos.net_position();
-            timestamp = pos.timestamp();
-            positions_[pos.strategy_name()][pos.symbol()].first = pos.net_position();
-            positions_[pos.strategy_name()][pos.symbol()].second = pos.timestamp();
+        // Updates are ordered by the owner's sequence number; timestamps are only compared when
+        // either side lacks one. An empty slot has timestamp 0, so the first update always lands.
+        const Position& position = shard.table.at(strategy_id, symbol_id);
+        bool newer = pos.seq() != 0 && position.seq != 0 ? pos.seq() > position.seq
+                                                          : pos.timestamp() > position.timestamp;
+        if (strategy_id == shard.self_id && pos.seq() != 0) {
+            // Our own update from before a restart. Number new updates after it so peers accept them.
+            std::lock_guard<std::mutex> lock(publish_mutex_);
+            last_seq_ = std::max(last_seq_, pos.seq());
+        }
+        if (newer) {
+            apply(shard, strategy_id, symbol_id, pos.net_position(), pos.timestamp(), pos.seq());
+            publish(shard, JournalKind::Position, strategy_id, symbol_id, position);
+        }
+    }
+
+    // Every write to a table goes through here so the shard digest and exposure stay in step with it.
+    static void apply(Shard& shard, uint32_t strategy_id, uint32_t symbol_id, double net_position, int64_t timestamp,
+                      uint64_t seq) {
+        Position& position = shard.table.at(strategy_id, symbol_id);
+        shard.exposure.set(symbol_id, position.net_position, net_position);
+        if (position.timestamp != 0) {
+            shard.digest.toggle(strategy_id, symbol_id, position);
         }
-        see_positions();
+        position.net_position = net_position;
+        position.timestamp = timestamp;
+        position.seq = seq;
+        shard.digest.toggle(strategy_id, symbol_id, position);
     }
 
-    void process_trade(Trade& trade) {
-        log("[Engine::process_trade] Processing trade on symbol " + trade.symbol());
+    void process_trade(Shard& shard, Trade& trade) {
+        LOG_DEBUG("[Engine::process_trade] Processing trade on symbol " + trade.symbol());
         auto now = std::chrono::system_clock::now();
         auto ns_since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch());
-        positions_[strategy_name_][trade.symbol()].first += trade.position();
-        positions_[strategy_name_][trade.symbol()].second = ns_since_epoch.count();
-        see_positions();
-
-        SymbolPos pos;
-        pos.set_symbol(trade.symbol());
-        pos.set_net_position(positions_[strategy_name_][trade.symbol()].first);
-        pos.set_strategy_name(strategy_name_);
-        pos.set_timestamp(ns_since_epoch.count());
-
-        std::string pos_msg;
-        if (!pos.SerializeToString(&pos_msg)) {
-            log("[Engine::process_trade] Failed to serialize gossip position for " + trade.symbol(), true);
+        uint32_t symbol_id = shard.table.symbols().intern(trade.symbol());
+        if (symbol_id == Interner::npos) {
+            log("[Engine::process_trade] Position table full, dropping trade on " + trade.symbol(), true);
             return;
         }
 
-        peer_->broadcast(pos_msg);
+        const Position& position = shard.table.at(shard.self_id, symbol_id);
+        double net_position = position.net_position + trade.position();
+        double other_net = 0, other_gross = 0;
+        for (const auto& other : shards_) {
+            if (other.get() == &shard) continue;
+            other_net += other->exposure.net_total();
+            other_gross += other->exposure.gross_total();
+        }
+        LimitCheck verdict = shard.exposure.check(symbol_id, shard.table.symbols(), position.net_position, net_position,
+                                                  other_net, other_gross);
+        if (verdict != LimitCheck::Ok) {
+            shard.rejected_trades[static_cast<std::size_t>(verdict)].add();
+            log("[Engine::process_trade] Rejected trade of " + std::to_string(trade.position()) + " " + trade.symbol()
+                + ": " + to_string(verdict) + " limit", true);
+            return;
+        }
+
+        // The new value is numbered when it is broadcast.
+        apply(shard, shard.self_id, symbol_id, net_position, ns_since_epoch.count(), position.seq);
+        publish(shard, JournalKind::Trade, shard.self_id, symbol_id, position);
+
+        shard.coalescer.add(symbol_id);
+        if (shard.coalescer.full()) {
+            flush_positions(shard);
+        }
     }
 
-    void consume_trades() {
-        log("[Engine::consume_trades] Consuming trades....");
+    // Broadcasts the latest own position of every symbol changed in the current window as a
+    // single PositionBatch.
+    void flush_positions(Shard& shard) {
+        // Peers must never see a position this process could lose in a crash.
+        if (shard.wal) shard.wal->commit();
+        shard.coalescer.flush([&](const std::vector<uint32_t>& symbol_ids) {
+            PositionBatch& batch = shard.outgoing_batch;
+            batch.Clear();
+            std::lock_guard<std::mutex> lock(publish_mutex_);
+            if (shard.wal && last_seq_ + symbol_ids.size() > seq_reserved_) {
+                reserve_seqs(shard, symbol_ids.size());
+            }
+            for (uint32_t symbol_id : symbol_ids) {
+                Position& position = shard.table.at(shard.self_id, symbol_id);
+                position.seq = ++last_seq_;
+                replay_ring_.push({position.seq, static_cast<uint32_t>(shard.index), symbol_id,
+                                   position.net_position, position.timestamp});
+                SymbolPos* pos = batch.add_positions();
+                pos->set_strategy_name(strategy_name_);
+                pos->set_symbol(shard.table.symbols().name(symbol_id));
+                pos->set_net_position(position.net_position);
+                pos->set_timestamp(position.timestamp);
+                pos->set_seq(position.seq);
+            }
+
+            SharedFrame frame = make_frame(MessageType::PositionBatch, batch, kFrameFanOut);
+            if (!frame) {
+                log("[Engine::flush_positions] Failed to serialize gossip batch of " + std::to_string(symbol_ids.size()) + " positions", true);
+                return;
+            }
+            if (!peer_->multicast(frame)) peer_->broadcast(frame);
+            shard.broadcasts.add();
+        });
+    }
+
+    // Records that own sequence numbers up to last_seq_ + count + kSeqReservation may be used,
+    // before any of them is. Called under publish_mutex_.
+    void reserve_seqs(Shard& shard, std::size_t count) {
+        seq_reserved_ = last_seq_ + count + kSeqReservation;
+        shard.wal->append(JournalRecord{JournalKind::Seq, {}, {}, 0, static_cast<int64_t>(seq_reserved_)});
+        shard.wal->commit();
+    }
+
+    // Drains every lane of a shard. This is the only thread that writes to shard.table.
+    void consume(Shard& shard) {
+        log("[Engine::consume] Shard " + std::to_string(shard.index) + " consuming trades and positions....");
+        unsigned idle_spins = 0;
         while (running_.load(std::memory_order_acquire)) {
-            Trade* trade = nullptr;
-            if (trades_queue_.pop(trade)) {
-                process_trade(*trade);
+            uint32_t epoch = shard.data_ready.epoch();
+            std::size_t processed = drain(shard) + run_tasks(shard);
+
+            auto timeout = std::chrono::nanoseconds(WaitStrategy::kMaxBlockingWait);
+            auto now = Coalescer::Clock::now();
+            if (shard.wal && shard.wal->size() > 0 && now >= shard.next_snapshot) {
+                take_snapshot(shard);
+            }
+            if (!shard.coalescer.empty()) {
+                if (shard.coalescer.immediate() || shard.coalescer.expired(now)) {
+                    flush_positions(shard);
+                } else {
+                    timeout = shard.coalescer.deadline() - now;
+                }
             }
+
+            if (processed > 0) {
+                idle_spins = 0;
+                continue;
+            }
+            wait_strategy_.wait(shard.data_ready, epoch, idle_spins, timeout);
         }
 
-        log("[Engine::consume_trades] Stopping, processing last few trades in trades_queue....");
-        Trade* trade = nullptr;
-        while (trades_queue_.pop(trade)) {
-            process_trade(*trade);
+        log("[Engine::consume] Shard " + std::to_string(shard.index) + " stopping, processing last few messages....");
+        drain(shard);
+        run_tasks(shard);
+        if (!shard.coalescer.empty()) {
+            flush_positions(shard);
+        }
+        if (shard.wal) {
+            take_snapshot(shard, true);
         }
     }
 
-    void consume_positions() {
-        log("[Engine::consume_positions] Consuming trades....");
-        while (running_.load(std::memory_order_acquire)) {
-            SymbolPos* position = nullptr;
-            if (positions_queue_.pop(position)) {
-                process_positions(*position);
+    // Copies the shard's table and moves its log on to the next generation, then leaves writing
+    // the snapshot, and deleting the logs it covers, to the snapshot writer. Unless forced, skips
+    // a shard whose previous snapshot is still being written.
+    void take_snapshot(Shard& shard, bool force = false) {
+        shard.next_snapshot = Coalescer::Clock::now() + snapshot_interval_;
+        if (!force && shard.snapshot_in_flight.load(std::memory_order_acquire)) return;
+        shard.wal->commit();
+        std::unique_ptr<WriteAheadLog> next_log;
+        try {
+            next_log = std::make_unique<WriteAheadLog>(log_file(shard.index, shard.log_generation + 1), fsync_);
+        } catch (const std::exception& e) {
+            log("[Engine::take_snapshot] " + std::string(e.what()), true);
+            return;
+        }
+        uint64_t last_seq;
+        {
+            std::lock_guard<std::mutex> lock(publish_mutex_);
+            last_seq = seq_reserved_;
+        }
+        auto image = std::make_shared<snapshot::Image>();
+        snapshot::capture(shard.table, ++shard.log_generation, last_seq, *image);
+        shard.wal = std::move(next_log);
+        shard.snapshot_in_flight.store(true, std::memory_order_release);
+        snapshot_writer_.post([this, &shard, image] {
+            if (snapshot::write(shard_file(shard.index, ".snap"), shard.table, *image, fsync_)) {
+                remove_logs(shard.index, image->log_generation);
             }
+            shard.snapshot_in_flight.store(false, std::memory_order_release);
+        });
+    }
+
+    std::string shard_file(std::size_t index, const std::string& extension) const {
+        return (std::filesystem::path(data_dir_) / ("shard-" + std::to_string(index) + extension)).string();
+    }
+
+    std::string log_file(std::size_t index, uint64_t generation) const {
+        return shard_file(index, "." + std::to_string(generation) + ".wal");
+    }
+
+    // The generations of shard index's logs in data_dir_, oldest first.
+    std::vector<uint64_t> log_generations(std::size_t index) const {
+        std::string prefix = "shard-" + std::to_string(index) + ".";
+        std::vector<uint64_t> generations;
+        for (const auto& file : std::filesystem::directory_iterator(data_dir_)) {
+            std::string name = file.path().filename().string();
+            if (name.rfind(prefix, 0) != 0 || file.path().extension() != ".wal") continue;
+            try {
+                generations.push_back(std::stoull(name.substr(prefix.size())));
+            } catch (const std::exception&) {}
+        }
+        std::sort(generations.begin(), generations.end());
+        return generations;
+    }
+
+    // Deletes shard index's logs older than generation.
+    void remove_logs(std::size_t index, uint64_t generation) {
+        for (uint64_t old_generation : log_generations(index)) {
+            if (old_generation >= generation) break;
+            std::error_code ec;
+            std::filesystem::remove(log_file(index, old_generation), ec);
+        }
+    }
+
+    // Rebuilds the tables from what the previous run left in data_dir_: each of its shards'
+    // snapshot, then that shard's logs from the first generation the snapshot does not cover. The
+    // previous run may have had a different shard count, so every cell is routed by symbol. Each
+    // shard then starts from a fresh snapshot and a new log generation. Runs before the workers
+    // start.
+    void recover() {
+        auto start = std::chrono::steady_clock::now();
+        std::filesystem::create_directories(data_dir_);
+
+        std::set<std::size_t> previous_shards;
+        for (const auto& file : std::filesystem::directory_iterator(data_dir_)) {
+            std::string name = file.path().filename().string();
+            std::string extension = file.path().extension().string();
+            if (name.rfind("shard-", 0) != 0 || (extension != ".snap" && extension != ".wal")) continue;
+            try {
+                previous_shards.insert(std::stoul(name.substr(6)));
+            } catch (const std::exception&) {}
+        }
+
+        std::size_t snapshot_entries = 0;
+        std::size_t log_records = 0;
+        uint64_t generation = 0;
+        for (std::size_t index : previous_shards) {
+            uint64_t first_uncovered = 0;
+            uint64_t snapshot_seq = 0;
+            snapshot::load(shard_file(index, ".snap"), first_uncovered, snapshot_seq, [&](const JournalRecord& record) {
+                restore(record);
+                ++snapshot_entries;
+            });
+            generation = std::max(generation, first_uncovered);
+            last_seq_ = std::max(last_seq_, snapshot_seq);
+            for (uint64_t log_generation : log_generations(index)) {
+                generation = std::max(generation, log_generation);
+                if (log_generation < first_uncovered) continue;
+                log_records += WriteAheadLog::replay(log_file(index, log_generation), [&](const JournalRecord& record) {
+                    if (record.kind == JournalKind::Seq) {
+                        last_seq_ = std::max(last_seq_, static_cast<uint64_t>(record.timestamp));
+                    } else {
+                        restore(record);
+                    }
+                });
+            }
+        }
+
+        // Cells are stored without their sequence numbers. Renumbering the recovered own positions
+        // after everything the previous run may have used lets them replace whatever peers still
+        // hold from before the crash.
+        for (auto& shard : shards_) {
+            shard->table.for_each_in_row(shard->self_id, [&](uint32_t symbol_id, const Position&) {
+                shard->table.at(shard->self_id, symbol_id).seq = ++last_seq_;
+            });
+        }
+        seq_reserved_ = last_seq_;
+
+        // Every shard moves past every generation the previous run used, so none of its logs is
+        // replayed again.
+        ++generation;
+        for (auto& shard : shards_) {
+            if (!snapshot::write(shard_file(shard->index, ".snap"), shard->table, generation, seq_reserved_, fsync_)) {
+                throw std::runtime_error("Cannot write snapshot to " + data_dir_);
+            }
+        }
+        for (std::size_t index : previous_shards) {
+            remove_logs(index, generation);
+            if (index >= shards_.size()) {
+                std::filesystem::remove(shard_file(index, ".snap"));
+            }
+        }
+        for (auto& shard : shards_) {
+            shard->log_generation = generation;
+            shard->wal = std::make_unique<WriteAheadLog>(log_file(shard->index, generation), fsync_);
+            shard->next_snapshot = Coalescer::Clock::now() + snapshot_interval_;
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        log("[Engine::recover] Restored " + std::to_string(snapshot_entries) + " snapshot entries and "
+            + std::to_string(log_records) + " log records from " + data_dir_ + " in " + std::to_string(elapsed.count()) + "ms");
+    }
+
+    // Log records are in apply order, so the last record for a cell is its latest state.
+    void restore(const JournalRecord& record) {
+        Shard& shard = shard_for(record.symbol);
+        uint32_t strategy_id = shard.table.strategies().intern(std::string(record.strategy));
+        uint32_t symbol_id = shard.table.symbols().intern(std::string(record.symbol));
+        if (strategy_id == Interner::npos || symbol_id == Interner::npos) {
+            log("[Engine::restore] Position table full, dropping " + std::string(record.symbol) + " from " + std::string(record.strategy), true);
+            return;
+        }
+        apply(shard, strategy_id, symbol_id, record.net_position, record.timestamp, 0);
+    }
+
+    std::size_t drain(Shard& shard) {
+        std::size_t processed = 0;
+        for (auto& lane : shard.trade_lanes) {
+            processed += lane->queue.consume_all([this, &shard, &lane](uint32_t slot) {
+                process_trade(shard, lane->pool[slot]);
+                shard.trade_latency.record(metrics::now_ns() - lane->enqueued_at[slot]);
+                lane->dequeued.add();
+                lane->pool.release(slot);
+            });
+        }
+        for (auto& lane : shard.position_lanes) {
+            processed += lane->queue.consume_all([this, &shard, &lane](uint32_t slot) {
+                process_positions(shard, lane->pool[slot]);
+                shard.position_latency.record(metrics::now_ns() - lane->enqueued_at[slot]);
+                lane->dequeued.add();
+                lane->pool.release(slot);
+            });
+        }
+        if (processed > 0) {
+            wait_strategy_.notify(shard.space_ready);
+            // Group commit: one write (and one fdatasync) for everything applied in this pass.
+            if (shard.wal) shard.wal->commit();
         }
-        log("[Engine::consume_positions] Stopping....");
+        return processed;
     }
 };
 
@@ -1,69 +1,59 @@
 #ifndef MYSERVER_EVENTDISPATCHER_H
 #define MYSERVER_EVENTDISPATCHER_H
 
+#include <atomic>
 #include <functional>
-#include <vector>
-#include <shared_mutex>
+#include <memory>
+#include <mutex>
 #include <utility>
-
-class IInvokable {
-public:
-    virtual ~IInvokable() = default;
-    virtual void invoke() = 0;
-};
+#include <vector>
 
 
+// Statically typed event, e.g. Event<const FrameView&>. Handlers are called directly with the
+// arguments they were declared with: no RTTI and no allocation per call.
+//
+// Subscribing is copy-on-write: += builds a new handler list and publishes it with one atomic
+// store, so invoking only loads a pointer and never takes a lock. Old lists are kept until the
+// event is destroyed, since an invocation on another thread may still be walking them; handlers
+// are registered a handful of times at startup, so this costs next to nothing.
 template<typename... Args>
-class EventHandler : public IInvokable {
+class Event {
 public:
-    using FunctionType = std::function<void(Args...)>;
+    using Handler = std::function<void(Args...)>;
 
-    explicit EventHandler(FunctionType func)
-            : function_(std::move(func)) {}
-
-    void invoke() override {
-        if (function_ && args_) {
-            std::apply(function_, *args_);
+    Event() = default;
+    Event(const Event&) = delete;
+    Event& operator=(const Event&) = delete;
+
+    void operator+=(Handler handler) {
+        std::lock_guard<std::mutex> lock(subscribe_mutex_);
+        auto handlers = std::make_unique<HandlerList>();
+        if (const HandlerList* current = handlers_.load(std::memory_order_acquire)) {
+            *handlers = *current;
         }
+        handlers->push_back(std::move(handler));
+        handlers_.store(handlers.get(), std::memory_order_release);
+        versions_.push_back(std::move(handlers));
     }
 
-    void set_args(Args... args) {
-        args_ = std::make_shared<std::tuple<Args...>>(std::forward<Args>(args)...);
-    }
-
-private:
-    FunctionType function_;
-    std::shared_ptr<std::tuple<Args...>> args_;
-};
-
-
-class Event {
-public:
-    Event() = default;
-
-    template<typename... Args>
-    void operator+=(std::function<void(Args...)> handler) {
-        std::unique_lock lock(mutex_);
-
-        handlers_.emplace_back(
-            std::make_unique<EventHandler<Args...>>(handler)
-        );
+    void operator()(Args... args) const {
+        const HandlerList* handlers = handlers_.load(std::memory_order_acquire);
+        if (!handlers) return;
+        for (const Handler& handler : *handlers) {
+            handler(args...);
+        }
     }
 
-    template<typename... Args>
-    void operator()(Args&&... args) {
-        std::shared_lock lock(mutex_);
-        for (auto& handler : handlers_) {
-            if (auto h = dynamic_cast<EventHandler<std::decay_t<Args>...>*>(handler.get())) {
-                h->set_args(std::forward<Args>(args)...);
-                h->invoke();
-            }
-        }
+    bool empty() const {
+        return handlers_.load(std::memory_order_acquire) == nullptr;
     }
 
 private:
-    std::vector<std::unique_ptr<IInvokable>> handlers_;
-    mutable std::shared_mutex mutex_;
+    using HandlerList = std::vector<Handler>;
+
+    std::atomic<const HandlerList*> handlers_{nullptr};
+    std::mutex subscribe_mutex_;
+    std::vector<std::unique_ptr<const HandlerList>> versions_;
 };
 
 
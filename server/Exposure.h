@@ -0,0 +1,247 @@
+#ifndef MYSERVER_EXPOSURE_H
+#define MYSERVER_EXPOSURE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "PositionTable.h"
+
+
+// Firm-wide exposure, summed over every strategy in the book: per symbol the net position
+// (sum of nets) and gross position (sum of |net|), and per firm the sums of those over all
+// symbols. Quantities are in the units trades are booked in; there are no prices here.
+
+// A missing bound is infinite.
+struct ExposureLimit {
+    double max_net = std::numeric_limits<double>::infinity();     // bound on |net|
+    double max_gross = std::numeric_limits<double>::infinity();
+};
+
+struct ExposureLimits {
+    ExposureLimit firm;
+    ExposureLimit default_symbol;                              // symbols without their own line
+    std::unordered_map<std::string, ExposureLimit> symbols;
+
+    const ExposureLimit& for_symbol(const std::string& symbol) const {
+        auto it = symbols.find(symbol);
+        return it == symbols.end() ? default_symbol : it->second;
+    }
+
+    // One limit per line, "<symbol> <max net> <max gross>", where the symbol * sets the default
+    // for every other symbol, @firm sets the firm-wide limits, and - leaves a bound open.
+    // Blank lines and lines starting with # are ignored.
+    static ExposureLimits load(const std::string& path) {
+        std::ifstream in(path);
+        if (!in) throw std::runtime_error("Cannot read limits file " + path);
+        ExposureLimits limits;
+        std::string line;
+        for (int line_number = 1; std::getline(in, line); ++line_number) {
+            std::istringstream fields(line);
+            std::string name, net, gross, extra;
+            if (!(fields >> name) || name[0] == '#') continue;
+            if (!(fields >> net >> gross) || (fields >> extra)) {
+                throw std::runtime_error(path + ":" + std::to_string(line_number) + ": expected <symbol> <max net> <max gross>");
+            }
+            ExposureLimit limit{parse_bound(net, path, line_number), parse_bound(gross, path, line_number)};
+            if (name == "@firm") limits.firm = limit;
+            else if (name == "*") limits.default_symbol = limit;
+            else limits.symbols[name] = limit;
+        }
+        return limits;
+    }
+
+private:
+    static double parse_bound(const std::string& text, const std::string& path, int line_number) {
+        if (text == "-") return std::numeric_limits<double>::infinity();
+        try {
+            std::size_t used = 0;
+            double value = std::stod(text, &used);
+            if (used == text.size() && value >= 0) return value;
+        } catch (const std::exception&) {}
+        throw std::runtime_error(path + ":" + std::to_string(line_number) + ": invalid limit " + text);
+    }
+};
+
+
+enum class LimitCheck : uint8_t {
+    Ok,
+    SymbolNet,
+    SymbolGross,
+    FirmNet,
+    FirmGross,
+};
+constexpr std::size_t kLimitCheckKinds = 5;
+
+inline std::string to_string(LimitCheck check) {
+    switch (check) {
+        case LimitCheck::Ok: return "ok";
+        case LimitCheck::SymbolNet: return "symbol_net";
+        case LimitCheck::SymbolGross: return "symbol_gross";
+        case LimitCheck::FirmNet: return "firm_net";
+        case LimitCheck::FirmGross: return "firm_gross";
+    }
+    return "unknown";
+}
+
+
+// One shard's part of the exposure. The shard owns its symbols outright, so the per-symbol
+// figures here are already firm-wide; the firm totals are the sum of every shard's totals.
+//
+// Engine::apply reports every write to the table with set() before overwriting the cell, which
+// moves the aggregates by the difference between the new and the previous value, so nothing is
+// ever rescanned on the update path. audit() recomputes the aggregates from the table itself.
+//
+// Only the shard worker writes. Aggregates are atomics written with plain relaxed stores, so
+// other shards and the metrics thread can read them without a lock.
+class ShardExposure {
+public:
+    ShardExposure(std::size_t max_symbols, ExposureLimits limits):
+            symbol_net_(std::make_unique<std::atomic<double>[]>(max_symbols)),
+            symbol_gross_(std::make_unique<std::atomic<double>[]>(max_symbols)),
+            limits_(std::move(limits)),
+            symbol_limits_(max_symbols)
+    {}
+
+    // A cell of symbol_id moves from old_net to new_net.
+    void set(uint32_t symbol_id, double old_net, double new_net) {
+        double net_delta = new_net - old_net;
+        double gross_delta = std::fabs(new_net) - std::fabs(old_net);
+        add(symbol_net_[symbol_id], net_delta);
+        add(symbol_gross_[symbol_id], gross_delta);
+        add(net_total_, net_delta);
+        add(gross_total_, gross_delta);
+    }
+
+    // Pre-trade check of moving one cell from old_net to new_net, given the other shards' totals.
+    // A constant number of loads and compares; the symbol's limit is resolved once per symbol.
+    LimitCheck check(uint32_t symbol_id, const Interner& symbols, double old_net, double new_net,
+                     double other_shards_net, double other_shards_gross) {
+        const ExposureLimit& limit = symbol_limit(symbol_id, symbols);
+        double net_delta = new_net - old_net;
+        double gross_delta = std::fabs(new_net) - std::fabs(old_net);
+        double symbol_net = symbol_net_[symbol_id].load(std::memory_order_relaxed) + net_delta;
+        double symbol_gross = symbol_gross_[symbol_id].load(std::memory_order_relaxed) + gross_delta;
+        // A trade that reduces exposure is always allowed, even while over a limit.
+        if (std::fabs(symbol_net) > limit.max_net && std::fabs(symbol_net) > std::fabs(symbol_net - net_delta)) {
+            return LimitCheck::SymbolNet;
+        }
+        if (symbol_gross > limit.max_gross && gross_delta > 0) return LimitCheck::SymbolGross;
+        double firm_net = other_shards_net + net_total() + net_delta;
+        if (std::fabs(firm_net) > limits_.firm.max_net && std::fabs(firm_net) > std::fabs(firm_net - net_delta)) {
+            return LimitCheck::FirmNet;
+        }
+        if (other_shards_gross + gross_total() + gross_delta > limits_.firm.max_gross && gross_delta > 0) {
+            return LimitCheck::FirmGross;
+        }
+        return LimitCheck::Ok;
+    }
+
+    double symbol_net(uint32_t symbol_id) const { return symbol_net_[symbol_id].load(std::memory_order_relaxed); }
+    double symbol_gross(uint32_t symbol_id) const { return symbol_gross_[symbol_id].load(std::memory_order_relaxed); }
+    double net_total() const { return net_total_.load(std::memory_order_relaxed); }
+    double gross_total() const { return gross_total_.load(std::memory_order_relaxed); }
+
+    struct AuditResult {
+        double max_symbol_error = 0;   // largest difference of a symbol's net or gross
+        double net_error = 0;          // difference of the shard totals
+        double gross_error = 0;
+    };
+
+    // Recomputes every aggregate from the nets in the table and replaces the incremental values
+    // with the exact ones, reporting how far they had drifted: floating point rounding only,
+    // unless a write to the table bypassed set(). Worker thread only.
+    AuditResult audit(const PositionTable& table) {
+        uint32_t strategy_count = table.strategies().size();
+        uint32_t symbol_count = table.symbols().size();
+        // Rows are padded to a multiple of kLanes, so the last block stays inside its row.
+        std::size_t width = (symbol_count + kLanes - 1) / kLanes * kLanes;
+        audit_net_.resize(width);
+        audit_gross_.resize(width);
+        double* net = audit_net_.data();
+        double* gross = audit_gross_.data();
+        // kLanes symbols at a time, summed down every strategy's row in registers.
+        for (std::size_t i = 0; i < width; i += kLanes) {
+            double net_block[kLanes] = {};
+            double gross_block[kLanes] = {};
+            for (uint32_t strategy_id = 0; strategy_id < strategy_count; ++strategy_id) {
+                const Position* cells = &table.at(strategy_id, static_cast<uint32_t>(i));
+                for (std::size_t lane = 0; lane < kLanes; ++lane) {
+                    net_block[lane] += cells[lane].net_position;
+                    gross_block[lane] += std::fabs(cells[lane].net_position);
+                }
+            }
+            for (std::size_t lane = 0; lane < kLanes; ++lane) {
+                net[i + lane] = net_block[lane];
+                gross[i + lane] = gross_block[lane];
+            }
+        }
+
+        // Independent partial sums per lane, so the reduction vectorizes without reassociation.
+        double net_lanes[kLanes] = {};
+        double gross_lanes[kLanes] = {};
+        for (std::size_t i = 0; i < width; i += kLanes) {
+            for (std::size_t lane = 0; lane < kLanes; ++lane) {
+                net_lanes[lane] += net[i + lane];
+                gross_lanes[lane] += gross[i + lane];
+            }
+        }
+        double net_total = 0, gross_total = 0;
+        for (std::size_t lane = 0; lane < kLanes; ++lane) {
+            net_total += net_lanes[lane];
+            gross_total += gross_lanes[lane];
+        }
+
+        AuditResult result;
+        for (uint32_t symbol_id = 0; symbol_id < symbol_count; ++symbol_id) {
+            result.max_symbol_error = std::max({result.max_symbol_error,
+                                                std::fabs(symbol_net(symbol_id) - net[symbol_id]),
+                                                std::fabs(symbol_gross(symbol_id) - gross[symbol_id])});
+            symbol_net_[symbol_id].store(net[symbol_id], std::memory_order_relaxed);
+            symbol_gross_[symbol_id].store(gross[symbol_id], std::memory_order_relaxed);
+        }
+        result.net_error = std::fabs(this->net_total() - net_total);
+        result.gross_error = std::fabs(this->gross_total() - gross_total);
+        net_total_.store(net_total, std::memory_order_relaxed);
+        gross_total_.store(gross_total, std::memory_order_relaxed);
+        return result;
+    }
+
+private:
+    static constexpr std::size_t kLanes = 8;   // four SSE2 registers, two AVX2 ones or one AVX-512 one
+    static_assert(PositionTable::kRowMultiple % kLanes == 0, "audit() reads whole blocks of kLanes cells per row");
+
+    static void add(std::atomic<double>& value, double delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    // Symbol ids are dense, so limits are resolved by name once and then read by id.
+    const ExposureLimit& symbol_limit(uint32_t symbol_id, const Interner& symbols) {
+        while (resolved_ <= symbol_id) {
+            symbol_limits_[resolved_] = limits_.for_symbol(symbols.name(resolved_));
+            ++resolved_;
+        }
+        return symbol_limits_[symbol_id];
+    }
+
+    std::unique_ptr<std::atomic<double>[]> symbol_net_;
+    std::unique_ptr<std::atomic<double>[]> symbol_gross_;
+    alignas(kCacheLineSize) std::atomic<double> net_total_{0};
+    std::atomic<double> gross_total_{0};
+    ExposureLimits limits_;
+    std::vector<ExposureLimit> symbol_limits_;
+    uint32_t resolved_ = 0;
+    std::vector<double> audit_net_;
+    std::vector<double> audit_gross_;
+};
+
+#endif //MYSERVER_EXPOSURE_H
@@ -0,0 +1,132 @@
+#ifndef MYSERVER_FRAME_H
+#define MYSERVER_FRAME_H
+
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+#include <google/protobuf/message_lite.h>
+#include <memory>
+#include <string>
+
+
+// Wire envelope for every message exchanged between peers:
+//
+//     | version (1) | type (1) | flags (1) | reserved (1) | payload length (4, network order) | payload |
+//
+// The type tells the receiver which protobuf message the payload holds, so it is parsed
+// exactly once. Bump kFrameVersion whenever the header layout changes; unknown flags are ignored.
+enum class MessageType : uint8_t {
+    Trade = 1,
+    SymbolPos = 2,
+    PositionBatch = 3,
+    Digest = 4,
+    BucketRequest = 5,
+    CatchUpRequest = 6,
+    PositionSnapshot = 7,
+    SnapshotCredit = 8,
+    // Shared-memory transport control, handled by Peer and never dispatched to received_message.
+    ShmOffer = 9,
+    ShmAccept = 10,
+    ShmReady = 11,
+    ShmDoorbell = 12,
+    // Membership, see Membership.h. Join and Membership only travel between a peer and the
+    // registry; PeerHello opens every peer connection and is handled by Peer.
+    Join = 13,
+    Membership = 14,
+    PeerHello = 15,
+};
+
+// Set on broadcasts, which relays pass on to their other connections (see Peer::forward).
+constexpr uint8_t kFrameFanOut = 0x01;
+
+constexpr uint8_t kFrameVersion = 1;
+constexpr std::size_t kFrameHeaderSize = 8;
+constexpr uint32_t kMaxFramePayload = 64 * 1024 * 1024;
+
+struct FrameHeader {
+    uint8_t version;
+    MessageType type;
+    uint8_t flags;
+    uint32_t length;
+};
+
+// A received frame. data points into the connection's receive buffer (or its shared-memory
+// ring) and is only valid for the duration of the received_message handlers.
+struct FrameView {
+    MessageType type;
+    const char* data;
+    std::size_t size;
+    uint8_t flags = 0;
+};
+
+inline void encode_frame_header(char* out, MessageType type, uint32_t length, uint8_t flags = 0) {
+    uint32_t net_length = htonl(length);
+    out[0] = static_cast<char>(kFrameVersion);
+    out[1] = static_cast<char>(type);
+    out[2] = static_cast<char>(flags);
+    out[3] = 0;
+    std::memcpy(out + 4, &net_length, sizeof(uint32_t));
+}
+
+// Returns false if the header is from an unknown protocol version or announces an oversized payload.
+inline bool decode_frame_header(const char* in, FrameHeader& header) {
+    uint32_t net_length;
+    std::memcpy(&net_length, in + 4, sizeof(uint32_t));
+    header.version = static_cast<uint8_t>(in[0]);
+    header.type = static_cast<MessageType>(in[1]);
+    header.flags = static_cast<uint8_t>(in[2]);
+    header.length = ntohl(net_length);
+    return header.version == kFrameVersion && header.length <= kMaxFramePayload;
+}
+
+// An encoded frame (header + payload). Frames are immutable once built, so one serialization
+// can be queued on every connection at once.
+using SharedFrame = std::shared_ptr<const std::string>;
+
+// Serializes message straight behind its header. Returns nullptr if serialization fails.
+inline SharedFrame make_frame(MessageType type, const google::protobuf::MessageLite& message, uint8_t flags = 0) {
+    std::size_t size = message.ByteSizeLong();
+    if (size > kMaxFramePayload) return nullptr;
+    auto frame = std::make_shared<std::string>(kFrameHeaderSize + size, '\0');
+    encode_frame_header(frame->data(), type, static_cast<uint32_t>(size), flags);
+    if (!message.SerializeToArray(frame->data() + kFrameHeaderSize, static_cast<int>(size))) return nullptr;
+    return frame;
+}
+
+// A frame with an empty payload, for messages whose type says everything.
+inline SharedFrame make_frame(MessageType type) {
+    auto frame = std::make_shared<std::string>(kFrameHeaderSize, '\0');
+    encode_frame_header(frame->data(), type, 0);
+    return frame;
+}
+
+// A copy of a received frame, header and all, to send on as it is.
+inline SharedFrame make_frame(const FrameView& received) {
+    auto frame = std::make_shared<std::string>(kFrameHeaderSize + received.size, '\0');
+    encode_frame_header(frame->data(), received.type, static_cast<uint32_t>(received.size), received.flags);
+    std::memcpy(frame->data() + kFrameHeaderSize, received.data, received.size);
+    return frame;
+}
+
+inline std::string to_string(MessageType type) {
+    switch (type) {
+        case MessageType::Trade: return "Trade";
+        case MessageType::SymbolPos: return "SymbolPos";
+        case MessageType::PositionBatch: return "PositionBatch";
+        case MessageType::Digest: return "Digest";
+        case MessageType::BucketRequest: return "BucketRequest";
+        case MessageType::CatchUpRequest: return "CatchUpRequest";
+        case MessageType::PositionSnapshot: return "PositionSnapshot";
+        case MessageType::SnapshotCredit: return "SnapshotCredit";
+        case MessageType::ShmOffer: return "ShmOffer";
+        case MessageType::ShmAccept: return "ShmAccept";
+        case MessageType::ShmReady: return "ShmReady";
+        case MessageType::ShmDoorbell: return "ShmDoorbell";
+        case MessageType::Join: return "Join";
+        case MessageType::Membership: return "Membership";
+        case MessageType::PeerHello: return "PeerHello";
+    }
+    return "Unknown(" + std::to_string(static_cast<int>(type)) + ")";
+}
+
+#endif //MYSERVER_FRAME_H
@@ -0,0 +1,259 @@
+#ifndef MYSERVER_INGEST_H
+#define MYSERVER_INGEST_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <position.pb.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Journal.h"
+#include "utils.h"
+
+// Trade sources other than typed lines on stdin. Each source has the same shape: run(push) calls
+// push(const Trade&) for every trade, from the calling thread, until the source is exhausted or
+// stop() is called, and returns the number of trades pushed. The Trade handed to push is reused,
+// so a source costs no allocation per trade once the symbols have been seen.
+//
+// Binary trade record, native byte order (the feed and replay files are meant for the same host):
+//   [u16 body size][f64 position][symbol], body size = 8 + symbol size
+
+
+enum class TradeFormat {
+    Text,     // "<symbol> <position>" per line
+    Binary    // length-prefixed records
+};
+
+inline TradeFormat parse_trade_format(const std::string& name) {
+    if (name == "text") return TradeFormat::Text;
+    if (name == "binary") return TradeFormat::Binary;
+    throw std::invalid_argument("Unknown trade format: " + name + " (expected text or binary)");
+}
+
+constexpr std::size_t kTradeRecordHeaderSize = sizeof(uint16_t);
+constexpr std::size_t kTradeRecordMinBody = sizeof(double) + 1;
+
+inline void encode_trade_record(std::string& out, std::string_view symbol, double position) {
+    uint16_t body_size = static_cast<uint16_t>(sizeof(double) + symbol.size());
+    out.append(reinterpret_cast<const char*>(&body_size), sizeof(body_size));
+    out.append(reinterpret_cast<const char*>(&position), sizeof(position));
+    out.append(symbol);
+}
+
+enum class DecodeResult {
+    Ok,
+    NeedMore,   // the record at offset is incomplete
+    Invalid     // the record at offset cannot be a trade
+};
+
+// Decodes the record at offset into trade and advances offset past it.
+inline DecodeResult decode_trade_record(const char* data, std::size_t size, std::size_t& offset, Trade& trade) {
+    if (size - offset < kTradeRecordHeaderSize) return DecodeResult::NeedMore;
+    uint16_t body_size;
+    std::memcpy(&body_size, data + offset, sizeof(body_size));
+    if (body_size < kTradeRecordMinBody) return DecodeResult::Invalid;
+    if (size - offset - kTradeRecordHeaderSize < body_size) return DecodeResult::NeedMore;
+    const char* body = data + offset + kTradeRecordHeaderSize;
+    double position;
+    std::memcpy(&position, body, sizeof(position));
+    trade.set_symbol(body + sizeof(double), body_size - sizeof(double));
+    trade.set_position(position);
+    offset += kTradeRecordHeaderSize + body_size;
+    return DecodeResult::Ok;
+}
+
+
+// Paces a loop to rate iterations per second: sleeps while well ahead of schedule and spins for
+// the last stretch. A rate of 0 never waits.
+class RateLimiter {
+public:
+    explicit RateLimiter(uint64_t rate):
+            interval_ns_(rate > 0 ? 1'000'000'000 / static_cast<int64_t>(rate) : 0),
+            start_(std::chrono::steady_clock::now())
+    {}
+
+    void wait(uint64_t count) {
+        if (interval_ns_ == 0) return;
+        auto due = start_ + std::chrono::nanoseconds(static_cast<int64_t>(count) * interval_ns_);
+        auto ahead = due - std::chrono::steady_clock::now();
+        if (ahead > std::chrono::microseconds(200)) {
+            std::this_thread::sleep_for(ahead - std::chrono::microseconds(100));
+        }
+        while (std::chrono::steady_clock::now() < due) {}
+    }
+
+private:
+    int64_t interval_ns_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+
+// Replays a file of trades through a read-only mapping, optionally at a fixed rate. Malformed
+// text lines are skipped and counted; a malformed binary record ends the replay.
+class FileReplay {
+public:
+    FileReplay(std::string path, TradeFormat format, uint64_t rate):
+            path_(std::move(path)),
+            format_(format),
+            rate_(rate)
+    {}
+
+    template<typename F>
+    uint64_t run(F&& push) {
+        MappedFile file(path_);
+        if (!file.data()) {
+            log("[FileReplay::run] Cannot map " + path_ + " or it is empty", true);
+            return 0;
+        }
+        log("[FileReplay::run] Replaying " + std::to_string(file.size()) + " bytes of " + path_
+            + (rate_ > 0 ? " at " + std::to_string(rate_) + " trades/s" : std::string(" unthrottled")));
+
+        RateLimiter limiter(rate_);
+        Trade trade;
+        uint64_t pushed = 0;
+        uint64_t skipped = 0;
+        auto started = std::chrono::steady_clock::now();
+        const char* data = file.data();
+        std::size_t size = file.size();
+        std::size_t offset = 0;
+        while (offset < size && running_.load(std::memory_order_relaxed)) {
+            if (format_ == TradeFormat::Text) {
+                const void* newline = std::memchr(data + offset, '\n', size - offset);
+                std::size_t line_end = newline ? static_cast<const char*>(newline) - data : size;
+                std::string_view line(data + offset, line_end - offset);
+                offset = line_end + 1;
+                if (line.find_first_not_of(" \t\r") == std::string_view::npos) continue;
+                if (!parse_trade_line(line, trade)) {
+                    ++skipped;
+                    continue;
+                }
+            } else if (decode_trade_record(data, size, offset, trade) != DecodeResult::Ok) {
+                log("[FileReplay::run] Malformed record at byte " + std::to_string(offset) + " of " + path_, true);
+                break;
+            }
+            limiter.wait(pushed);
+            push(trade);
+            ++pushed;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        log("[FileReplay::run] Replayed " + std::to_string(pushed) + " trades in " + std::to_string(seconds) + "s ("
+            + std::to_string(static_cast<uint64_t>(static_cast<double>(pushed) / std::max(seconds, 1e-9))) + " trades/s)"
+            + (skipped > 0 ? ", skipped " + std::to_string(skipped) + " malformed lines" : ""));
+        return pushed;
+    }
+
+    void stop() {
+        running_.store(false, std::memory_order_relaxed);
+    }
+
+private:
+    std::string path_;
+    TradeFormat format_;
+    uint64_t rate_;
+    std::atomic<bool> running_{true};
+};
+
+
+// Listens on a Unix stream socket for producers writing binary trade records. Producers are
+// served one at a time, each until it disconnects; a producer that sends a malformed record is
+// dropped.
+class BinaryTradeFeed {
+public:
+    static constexpr std::size_t kReadBufferSize = 256 * 1024;
+
+    explicit BinaryTradeFeed(std::string path): path_(std::move(path)) {
+        sockaddr_un address{};
+        if (path_.size() >= sizeof(address.sun_path)) {
+            throw std::runtime_error("Trade feed socket path too long: " + path_);
+        }
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path_.c_str(), path_.size() + 1);
+        ::unlink(path_.c_str());
+        listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 || ::bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(listen_fd_, 4) != 0) {
+            std::string error = std::strerror(errno);
+            if (listen_fd_ >= 0) ::close(listen_fd_);
+            throw std::runtime_error("Cannot listen on trade feed " + path_ + ": " + error);
+        }
+        log("[BinaryTradeFeed::BinaryTradeFeed] Listening for trades on " + path_);
+    }
+
+    ~BinaryTradeFeed() {
+        ::close(listen_fd_);
+        ::unlink(path_.c_str());
+    }
+
+    BinaryTradeFeed(const BinaryTradeFeed&) = delete;
+    BinaryTradeFeed& operator=(const BinaryTradeFeed&) = delete;
+
+    template<typename F>
+    uint64_t run(F&& push) {
+        std::vector<char> buffer(kReadBufferSize);
+        Trade trade;
+        uint64_t pushed = 0;
+        while (running_.load(std::memory_order_acquire)) {
+            int client = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                if (errno == EINTR) continue;
+                if (running_.load(std::memory_order_acquire)) {
+                    log("[BinaryTradeFeed::run] accept failed on " + path_ + ": " + std::strerror(errno), true);
+                }
+                break;
+            }
+            client_fd_.store(client, std::memory_order_release);
+            uint64_t before = pushed;
+            std::size_t end = 0;
+            while (true) {
+                ssize_t received = ::recv(client, buffer.data() + end, buffer.size() - end, 0);
+                if (received < 0 && errno == EINTR) continue;
+                if (received <= 0) break;
+                end += static_cast<std::size_t>(received);
+
+                std::size_t offset = 0;
+                DecodeResult result;
+                while ((result = decode_trade_record(buffer.data(), end, offset, trade)) == DecodeResult::Ok) {
+                    push(trade);
+                    ++pushed;
+                }
+                if (result == DecodeResult::Invalid) {
+                    log("[BinaryTradeFeed::run] Malformed trade record, dropping producer", true);
+                    break;
+                }
+                std::memmove(buffer.data(), buffer.data() + offset, end - offset);
+                end -= offset;
+            }
+            client_fd_.store(-1, std::memory_order_release);
+            ::close(client);
+            log("[BinaryTradeFeed::run] Producer disconnected after " + std::to_string(pushed - before) + " trades");
+        }
+        return pushed;
+    }
+
+    // Wakes run() from accept or recv.
+    void stop() {
+        running_.store(false, std::memory_order_release);
+        ::shutdown(listen_fd_, SHUT_RDWR);
+        int client = client_fd_.load(std::memory_order_acquire);
+        if (client >= 0) ::shutdown(client, SHUT_RDWR);
+    }
+
+private:
+    std::string path_;
+    int listen_fd_ = -1;
+    std::atomic<int> client_fd_{-1};
+    std::atomic<bool> running_{true};
+};
+
+#endif //MYSERVER_INGEST_H
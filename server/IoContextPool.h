@@ -0,0 +1,96 @@
+#ifndef MYSERVER_IOCONTEXTPOOL_H
+#define MYSERVER_IOCONTEXTPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <boost/asio.hpp>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+namespace asio = boost::asio;
+
+
+// One io_context per network thread. Each connection is bound to a single io_context for its
+// whole life, so all of its reads, writes and timers run on one thread and need no strand.
+class IoContextPool {
+public:
+    // Thread i is pinned to core (first_core + i) % hardware_concurrency. -1 disables pinning.
+    explicit IoContextPool(std::size_t size, int first_core = -1):
+            first_core_(first_core),
+            next_(0)
+    {
+        for (std::size_t i = 0; i < std::max<std::size_t>(size, 1); ++i) {
+            contexts_.push_back(std::make_unique<asio::io_context>(1));
+            work_guards_.push_back(asio::make_work_guard(*contexts_.back()));
+        }
+    }
+
+    ~IoContextPool() {
+        stop();
+        join();
+    }
+
+    void run() {
+        for (std::size_t i = 0; i < contexts_.size(); ++i) {
+            threads_.emplace_back([this, i] {
+                current_index_ = static_cast<int>(i);
+                // Keep serving if a handler throws, like the single threaded loop in main did.
+                while (!contexts_[i]->stopped()) {
+                    try {
+                        contexts_[i]->run();
+                    } catch (const std::exception& e) {
+                        log(std::string("[IoContextPool::run] Handler threw: ") + e.what(), true);
+                    }
+                }
+            });
+            if (first_core_ >= 0) {
+                pin_thread_to_core(threads_.back(), first_core_ + static_cast<int>(i));
+            }
+        }
+    }
+
+    void stop() {
+        for (auto& context : contexts_) {
+            context->stop();
+        }
+    }
+
+    void join() {
+        for (auto& thread : threads_) {
+            if (thread.joinable()) thread.join();
+        }
+    }
+
+    asio::io_context& get(std::size_t index) {
+        return *contexts_[index];
+    }
+
+    // Round robin, used to spread new connections across threads.
+    asio::io_context& get_next() {
+        return *contexts_[next_.fetch_add(1, std::memory_order_relaxed) % contexts_.size()];
+    }
+
+    std::size_t size() const {
+        return contexts_.size();
+    }
+
+    // Index of the pool thread calling this, or -1 when called from any other thread.
+    static int current_index() {
+        return current_index_;
+    }
+
+private:
+    using WorkGuard = asio::executor_work_guard<asio::io_context::executor_type>;
+
+    std::vector<std::unique_ptr<asio::io_context>> contexts_;
+    std::vector<WorkGuard> work_guards_;
+    std::vector<std::thread> threads_;
+    int first_core_;
+    std::atomic<std::size_t> next_;
+    static inline thread_local int current_index_ = -1;
+};
+
+#endif //MYSERVER_IOCONTEXTPOOL_H
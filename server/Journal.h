@@ -0,0 +1,476 @@
+#ifndef MYSERVER_JOURNAL_H
+#define MYSERVER_JOURNAL_H
+
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "PositionTable.h"
+#include "utils.h"
+
+// On-disk state of a shard: a snapshot of its position table plus a write-ahead log of every
+// change applied since. Both store resulting positions rather than the trades that produced
+// them, so recovery is "load the snapshot, then let each WAL record overwrite its cell".
+//
+// The log is split into numbered generations. Taking a snapshot starts the next generation, and
+// the snapshot records the first generation it does not cover, so older logs can be deleted once
+// it is on disk and are skipped if a crash leaves them behind.
+//
+// Integers and doubles are written in native byte order; the files are meant to be read back by
+// the same host.
+
+
+enum class JournalKind : uint8_t {
+    Trade = 1,      // own position changed by a local trade
+    Position = 2,   // position received from a peer
+    Seq = 3         // own sequence numbers reserved up to timestamp; no strategy or symbol
+};
+
+struct JournalRecord {
+    JournalKind kind;
+    std::string_view strategy;
+    std::string_view symbol;
+    double net_position;
+    int64_t timestamp;
+};
+
+
+inline uint32_t crc32(const char* data, std::size_t size, uint32_t crc = 0) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (std::size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+// Read-only mapping of a whole file. Empty when the file is missing or empty.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        struct stat st{};
+        if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* data = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                data_ = static_cast<const char*>(data);
+                size_ = static_cast<std::size_t>(st.st_size);
+            }
+        }
+        ::close(fd);
+    }
+
+    ~MappedFile() {
+        if (data_) ::munmap(const_cast<char*>(data_), size_);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+
+namespace journal_detail {
+
+template<typename T>
+void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Reads a T at offset and advances it. Returns false if fewer than sizeof(T) bytes remain.
+template<typename T>
+bool get(const char* data, std::size_t size, std::size_t& offset, T& value) {
+    if (size - offset < sizeof(T)) return false;
+    std::memcpy(&value, data + offset, sizeof(T));
+    offset += sizeof(T);
+    return true;
+}
+
+// Makes a file's creation, rename or removal in its directory durable.
+inline bool sync_directory(const std::string& file_path) {
+    std::string directory = std::filesystem::path(file_path).parent_path().string();
+    int fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+inline bool write_all(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= static_cast<std::size_t>(written);
+    }
+    return true;
+}
+
+}
+
+
+// Append-only log owned by one shard worker. append() only copies the record into a buffer;
+// commit() writes everything appended since the last commit with a single write() and, when
+// sync is set, a single fdatasync(), so one disk flush covers a whole batch of updates.
+//
+// Record: [u32 body size][u32 crc32 of body][body]
+// Body:   [u8 kind][u8 0][u16 strategy size][u16 symbol size][i64 timestamp][f64 net position]
+//         [strategy][symbol]
+class WriteAheadLog {
+public:
+    static constexpr std::size_t kRecordHeaderSize = 8;
+    static constexpr std::size_t kBodyFixedSize = 22;
+
+    WriteAheadLog(std::string path, bool sync): path_(std::move(path)), sync_(sync) {
+        fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("Cannot open write-ahead log " + path_ + ": " + std::strerror(errno));
+        }
+        if (sync_ && !journal_detail::sync_directory(path_)) {
+            log("[WriteAheadLog::WriteAheadLog] Failed to sync the directory of " + path_ + ": " + std::strerror(errno), true);
+        }
+        pending_.reserve(64 * 1024);
+    }
+
+    ~WriteAheadLog() {
+        commit();
+        ::close(fd_);
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    void append(const JournalRecord& record) {
+        using journal_detail::put;
+        std::size_t start = pending_.size();
+        put<uint32_t>(pending_, 0);
+        put<uint32_t>(pending_, 0);
+        put<uint8_t>(pending_, static_cast<uint8_t>(record.kind));
+        put<uint8_t>(pending_, 0);
+        put<uint16_t>(pending_, static_cast<uint16_t>(record.strategy.size()));
+        put<uint16_t>(pending_, static_cast<uint16_t>(record.symbol.size()));
+        put<int64_t>(pending_, record.timestamp);
+        put<double>(pending_, record.net_position);
+        pending_.append(record.strategy);
+        pending_.append(record.symbol);
+
+        const char* body = pending_.data() + start + kRecordHeaderSize;
+        uint32_t body_size = static_cast<uint32_t>(pending_.size() - start - kRecordHeaderSize);
+        uint32_t crc = crc32(body, body_size);
+        std::memcpy(pending_.data() + start, &body_size, sizeof(body_size));
+        std::memcpy(pending_.data() + start + sizeof(body_size), &crc, sizeof(crc));
+    }
+
+    // Returns false, and drops the batch, if it could not be written.
+    bool commit() {
+        if (pending_.empty()) return true;
+        bool ok = journal_detail::write_all(fd_, pending_.data(), pending_.size());
+        if (ok && sync_) {
+            ok = ::fdatasync(fd_) == 0;
+        }
+        if (!ok) {
+            log("[WriteAheadLog::commit] Failed to write " + std::to_string(pending_.size()) + " bytes to " + path_ + ": " + std::strerror(errno), true);
+        } else {
+            size_ += pending_.size();
+        }
+        pending_.clear();
+        return ok;
+    }
+
+    // Bytes committed to this log.
+    std::size_t size() const {
+        return size_;
+    }
+
+    const std::string& path() const {
+        return path_;
+    }
+
+    // Calls f(const JournalRecord&) for every intact record of the log at path. Stops at the
+    // first short or corrupt record, which is where a crash interrupted the last write.
+    template<typename F>
+    static std::size_t replay(const std::string& path, F&& f) {
+        using journal_detail::get;
+        MappedFile file(path);
+        const char* data = file.data();
+        std::size_t size = file.size();
+        std::size_t offset = 0;
+        std::size_t records = 0;
+        while (true) {
+            uint32_t body_size, crc;
+            if (!get(data, size, offset, body_size) || !get(data, size, offset, crc)) break;
+            if (body_size < kBodyFixedSize || size - offset < body_size) break;
+            const char* body = data + offset;
+            if (crc32(body, body_size) != crc) break;
+
+            std::size_t field = 0;
+            uint8_t kind, reserved;
+            uint16_t strategy_size, symbol_size;
+            JournalRecord record{};
+            get(body, body_size, field, kind);
+            get(body, body_size, field, reserved);
+            get(body, body_size, field, strategy_size);
+            get(body, body_size, field, symbol_size);
+            get(body, body_size, field, record.timestamp);
+            get(body, body_size, field, record.net_position);
+            if (body_size - field != static_cast<std::size_t>(strategy_size) + symbol_size) break;
+            record.kind = static_cast<JournalKind>(kind);
+            record.strategy = std::string_view(body + field, strategy_size);
+            record.symbol = std::string_view(body + field + strategy_size, symbol_size);
+
+            f(record);
+            offset += body_size;
+            ++records;
+        }
+        if (offset < size) {
+            log("[WriteAheadLog::replay] Ignoring " + std::to_string(size - offset) + " trailing bytes of " + path, true);
+        }
+        return records;
+    }
+
+private:
+    std::string path_;
+    bool sync_;
+    int fd_;
+    std::size_t size_ = 0;
+    std::string pending_;
+};
+
+
+// Point-in-time copy of a PositionTable.
+//
+// Layout: [8 byte magic][u32 strategy count][u32 symbol count][u32 entry count][u32 crc32 of
+// the rest], then [u64 first log generation not covered][u64 highest own sequence number the
+// engine may have used], then each strategy and symbol name as
+// [u16 size][bytes], then the populated cells as fixed size [u32 strategy id][u32 symbol id]
+// [f64 net position][i64 timestamp] entries.
+namespace snapshot {
+
+constexpr char kMagic[8] = {'P', 'D', 'S', 'N', 'A', 'P', '0', '3'};
+constexpr std::size_t kHeaderSize = sizeof(kMagic) + 4 * sizeof(uint32_t);
+
+struct Entry {
+    uint32_t strategy_id;
+    uint32_t symbol_id;
+    double net_position;
+    int64_t timestamp;
+};
+
+// The cells of a table, copied on the shard worker so the snapshot can be written elsewhere.
+// Names are not copied: interners only grow and a name never moves, so the writer reads them
+// from the live table by id.
+struct Image {
+    uint32_t strategy_count = 0;
+    uint32_t symbol_count = 0;
+    uint64_t log_generation = 0;
+    uint64_t last_seq = 0;
+    std::vector<Entry> entries;
+};
+
+inline void capture(const PositionTable& table, uint64_t log_generation, uint64_t last_seq, Image& image) {
+    image.strategy_count = table.strategies().size();
+    image.symbol_count = table.symbols().size();
+    image.log_generation = log_generation;
+    image.last_seq = last_seq;
+    image.entries.clear();
+    table.for_each([&](uint32_t strategy_id, uint32_t symbol_id, const Position& position) {
+        image.entries.push_back({strategy_id, symbol_id, position.net_position, position.timestamp});
+    });
+}
+
+// Written to path + ".tmp", synced, renamed over path and the rename synced, so a crash leaves
+// either the old or the new snapshot. Returns false (and logs) on failure, leaving the old
+// snapshot in place.
+inline bool write(const std::string& path, const PositionTable& table, const Image& image, bool sync) {
+    using journal_detail::put;
+    std::string body;
+    put<uint64_t>(body, image.log_generation);
+    put<uint64_t>(body, image.last_seq);
+    for (uint32_t id = 0; id < image.strategy_count; ++id) {
+        const std::string& name = table.strategies().name(id);
+        put<uint16_t>(body, static_cast<uint16_t>(name.size()));
+        body.append(name);
+    }
+    for (uint32_t id = 0; id < image.symbol_count; ++id) {
+        const std::string& name = table.symbols().name(id);
+        put<uint16_t>(body, static_cast<uint16_t>(name.size()));
+        body.append(name);
+    }
+    for (const Entry& entry : image.entries) {
+        put<uint32_t>(body, entry.strategy_id);
+        put<uint32_t>(body, entry.symbol_id);
+        put<double>(body, entry.net_position);
+        put<int64_t>(body, entry.timestamp);
+    }
+
+    std::string header(kMagic, sizeof(kMagic));
+    put<uint32_t>(header, image.strategy_count);
+    put<uint32_t>(header, image.symbol_count);
+    put<uint32_t>(header, static_cast<uint32_t>(image.entries.size()));
+    put<uint32_t>(header, crc32(body.data(), body.size()));
+
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0
+              && journal_detail::write_all(fd, header.data(), header.size())
+              && journal_detail::write_all(fd, body.data(), body.size())
+              && (!sync || ::fsync(fd) == 0);
+    if (fd >= 0) ::close(fd);
+    ok = ok && ::rename(tmp_path.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        log("[snapshot::write] Failed to write snapshot " + path + ": " + std::strerror(errno), true);
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    if (sync && !journal_detail::sync_directory(path)) {
+        log("[snapshot::write] Failed to sync the directory of " + path + ": " + std::strerror(errno), true);
+        return false;
+    }
+    return true;
+}
+
+inline bool write(const std::string& path, const PositionTable& table, uint64_t log_generation, uint64_t last_seq,
+                  bool sync) {
+    Image image;
+    capture(table, log_generation, last_seq, image);
+    return write(path, table, image, sync);
+}
+
+// Maps the snapshot at path and calls f(const JournalRecord&) for each entry, and sets
+// log_generation to the first log it does not cover and last_seq to the own sequence numbers it
+// covers. Returns false if the file is missing or does not validate.
+template<typename F>
+bool load(const std::string& path, uint64_t& log_generation, uint64_t& last_seq, F&& f) {
+    using journal_detail::get;
+    MappedFile file(path);
+    const char* data = file.data();
+    std::size_t size = file.size();
+    if (size < kHeaderSize || std::memcmp(data, kMagic, sizeof(kMagic)) != 0) return false;
+
+    std::size_t offset = sizeof(kMagic);
+    uint32_t strategy_count, symbol_count, entries, crc;
+    get(data, size, offset, strategy_count);
+    get(data, size, offset, symbol_count);
+    get(data, size, offset, entries);
+    get(data, size, offset, crc);
+    if (crc32(data + offset, size - offset) != crc) {
+        log("[snapshot::load] Checksum mismatch in " + path, true);
+        return false;
+    }
+    if (!get(data, size, offset, log_generation) || !get(data, size, offset, last_seq)) return false;
+
+    std::vector<std::string_view> names;
+    names.reserve(strategy_count + symbol_count);
+    for (uint32_t i = 0; i < strategy_count + symbol_count; ++i) {
+        uint16_t name_size;
+        if (!get(data, size, offset, name_size) || size - offset < name_size) return false;
+        names.emplace_back(data + offset, name_size);
+        offset += name_size;
+    }
+
+    for (uint32_t i = 0; i < entries; ++i) {
+        uint32_t strategy_id, symbol_id;
+        JournalRecord record{JournalKind::Position, {}, {}, 0, 0};
+        if (!get(data, size, offset, strategy_id) || !get(data, size, offset, symbol_id)
+            || !get(data, size, offset, record.net_position) || !get(data, size, offset, record.timestamp)) {
+            return false;
+        }
+        if (strategy_id >= strategy_count || symbol_id >= symbol_count) return false;
+        record.strategy = names[strategy_id];
+        record.symbol = names[strategy_count + symbol_id];
+        f(record);
+    }
+    return true;
+}
+
+}
+
+
+// Background thread that runs snapshot writes in the order they were posted, so the shard
+// workers never serialise or sync a snapshot themselves. stop() runs whatever is still queued.
+class SnapshotWriter {
+public:
+    SnapshotWriter(): thread_([this] { run(); }) {}
+
+    ~SnapshotWriter() {
+        stop();
+    }
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    void post(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            jobs_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) thread_.join();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty()) return;
+            std::function<void()> job = std::move(jobs_.front());
+            jobs_.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+#endif //MYSERVER_JOURNAL_H
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Logger.h"
+
+namespace {
+
+constexpr std::size_t kRecordText = 232;
+constexpr std::size_t kRingRecords = 4096;
+// Messages longer than this many records (dumps such as the positions command, never the hot
+// path) are written synchronously instead, so they are neither dropped nor able to fill a ring.
+constexpr std::size_t kMaxQueuedRecords = kRingRecords / 4;
+constexpr std::chrono::milliseconds kWriterIdleSleep{1};
+
+// Fixed size so a record can be copied into the ring without allocating. Longer messages span
+// several consecutive records, all but the last with more set.
+struct LogRecord {
+    int64_t timestamp_ns;
+    LogLevel level;
+    bool more;
+    uint16_t length;
+    char text[kRecordText];
+};
+
+struct ThreadBuffer {
+    boost::lockfree::spsc_queue<LogRecord, boost::lockfree::capacity<kRingRecords>> ring;
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> retired{false};
+
+    // Writer side only: a multi record message whose tail has not been drained yet.
+    std::string partial;
+    int64_t partial_timestamp_ns = 0;
+    LogLevel partial_level = LogLevel::Info;
+};
+
+std::atomic<LogLevel> current_level{LogLevel::Info};
+
+class AsyncLogger {
+public:
+    static AsyncLogger& instance() {
+        static AsyncLogger logger;
+        return logger;
+    }
+
+    ~AsyncLogger() {
+        running_.store(false, std::memory_order_release);
+        if (writer_.joinable()) writer_.join();
+        flush();
+    }
+
+    void append(LogLevel level, std::string_view message) {
+        ThreadBuffer& buffer = thread_buffer();
+        std::size_t records = std::max<std::size_t>(1, (message.size() + kRecordText - 1) / kRecordText);
+        if (records > kMaxQueuedRecords) {
+            write_now(level, message);
+            return;
+        }
+        // All or nothing, so the writer never prints half a message.
+        if (buffer.ring.write_available() < records) {
+            buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        LogRecord record;
+        record.timestamp_ns = now;
+        record.level = level;
+        for (std::size_t offset = 0, i = 0; i < records; ++i, offset += kRecordText) {
+            std::size_t length = std::min(kRecordText, message.size() - offset);
+            record.more = i + 1 < records;
+            record.length = static_cast<uint16_t>(length);
+            std::memcpy(record.text, message.data() + offset, length);
+            buffer.ring.push(record);
+        }
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        drain();
+    }
+
+private:
+    AsyncLogger(): running_(true) {
+        writer_ = std::thread([this] { run(); });
+    }
+
+    ThreadBuffer& thread_buffer() {
+        struct Holder {
+            std::shared_ptr<ThreadBuffer> buffer;
+            ~Holder() {
+                if (buffer) buffer->retired.store(true, std::memory_order_release);
+            }
+        };
+        thread_local Holder holder;
+        if (!holder.buffer) {
+            holder.buffer = std::make_shared<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock(buffers_mutex_);
+            buffers_.push_back(holder.buffer);
+        }
+        return *holder.buffer;
+    }
+
+    // Drains first, so the message still follows everything this thread logged before it.
+    void write_now(LogLevel level, std::string_view message) {
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        std::lock_guard<std::mutex> lock(drain_mutex_);
+        drain();
+        append_line(level, now, message);
+        write_all(STDOUT_FILENO, out_);
+        write_all(STDERR_FILENO, err_);
+    }
+
+    void run() {
+        while (running_.load(std::memory_order_acquire)) {
+            std::size_t written;
+            {
+                std::lock_guard<std::mutex> lock(drain_mutex_);
+                written = drain();
+            }
+            if (written == 0) {
+                std::this_thread::sleep_for(kWriterIdleSleep);
+            }
+        }
+    }
+
+    // Formats every pending record of every thread and writes them out in one go per stream.
+    std::size_t drain() {
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        {
+            std::lock_guard<std::mutex> lock(buffers_mutex_);
+            buffers = buffers_;
+        }
+
+        std::size_t records = 0;
+        for (auto& buffer : buffers) {
+            records += buffer->ring.consume_all([this, &buffer](const LogRecord& record) {
+                std::string_view text(record.text, record.length);
+                if (buffer->partial.empty() && !record.more) {
+                    append_line(record.level, record.timestamp_ns, text);
+                    return;
+                }
+                if (buffer->partial.empty()) {
+                    buffer->partial_timestamp_ns = record.timestamp_ns;
+                    buffer->partial_level = record.level;
+                }
+                buffer->partial.append(text);
+                if (!record.more) {
+                    append_line(buffer->partial_level, buffer->partial_timestamp_ns, buffer->partial);
+                    buffer->partial.clear();
+                }
+            });
+
+            uint64_t dropped = buffer->dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+                append_line(LogLevel::Error, now,
+                            "[Logger] Log buffer full, dropped " + std::to_string(dropped) + " messages");
+            }
+        }
+
+        write_all(STDOUT_FILENO, out_);
+        write_all(STDERR_FILENO, err_);
+
+        std::lock_guard<std::mutex> lock(buffers_mutex_);
+        buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(), [](const std::shared_ptr<ThreadBuffer>& buffer) {
+            return buffer->retired.load(std::memory_order_acquire) && buffer->ring.read_available() == 0;
+        }), buffers_.end());
+        return records;
+    }
+
+    void append_line(LogLevel level, int64_t timestamp_ns, std::string_view text) {
+        std::string& out = level == LogLevel::Error ? err_ : out_;
+        out.append(format_time(timestamp_ns));
+        out.append(text);
+        out.push_back('\n');
+    }
+
+    // Same "%Y-%m-%d %X " prefix log() always printed, only recomputed when the second changes.
+    const std::string& format_time(int64_t timestamp_ns) {
+        std::time_t seconds = static_cast<std::time_t>(timestamp_ns / 1000000000);
+        if (seconds != cached_second_) {
+            std::tm local{};
+            localtime_r(&seconds, &local);
+            char text[32];
+            std::size_t length = std::strftime(text, sizeof(text), "%Y-%m-%d %X ", &local);
+            cached_time_.assign(text, length);
+            cached_second_ = seconds;
+        }
+        return cached_time_;
+    }
+
+    static void write_all(int fd, std::string& data) {
+        std::size_t offset = 0;
+        while (offset < data.size()) {
+            ssize_t written = ::write(fd, data.data() + offset, data.size() - offset);
+            if (written <= 0) break;
+            offset += static_cast<std::size_t>(written);
+        }
+        data.clear();
+    }
+
+    std::atomic<bool> running_;
+    std::thread writer_;
+    std::mutex buffers_mutex_;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+
+    // Everything below is only touched while holding drain_mutex_.
+    std::mutex drain_mutex_;
+    std::string out_;
+    std::string err_;
+    std::time_t cached_second_ = -1;
+    std::string cached_time_;
+};
+
+}
+
+void set_log_level(LogLevel level) {
+    current_level.store(level, std::memory_order_relaxed);
+}
+
+LogLevel log_level() {
+    return current_level.load(std::memory_order_relaxed);
+}
+
+void log_record(LogLevel level, std::string_view message) {
+    AsyncLogger::instance().append(level, message);
+}
+
+void flush_logs() {
+    AsyncLogger::instance().flush();
+}
+
+void log(const std::string& message, bool is_error) {
+    LogLevel level = is_error ? LogLevel::Error : LogLevel::Info;
+    if (log_enabled(level)) {
+        log_record(level, message);
+    }
+}
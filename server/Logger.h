@@ -0,0 +1,53 @@
+#ifndef MYSERVER_LOGGER_H
+#define MYSERVER_LOGGER_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Asynchronous logger. A logging thread only copies its message into a thread local lock-free
+// ring of fixed size records; a background thread drains every ring, formats the timestamps and
+// writes each batch to stdout/stderr with a single write. Records that do not fit in a full ring
+// are dropped and counted rather than blocking the caller. Very long messages skip the ring and
+// are written by the calling thread, so they are never dropped.
+//
+// Levels are filtered twice: MYSERVER_MIN_LOG_LEVEL removes LOG_DEBUG/LOG_INFO calls at compile
+// time (the message expression is never evaluated), and set_log_level() filters at runtime.
+
+enum class LogLevel : uint8_t {
+    Debug = 0,
+    Info = 1,
+    Error = 2,
+};
+
+#ifndef MYSERVER_MIN_LOG_LEVEL
+#define MYSERVER_MIN_LOG_LEVEL 0
+#endif
+
+void set_log_level(LogLevel level);
+LogLevel log_level();
+
+inline bool log_enabled(LogLevel level) {
+    return level >= log_level();
+}
+
+void log_record(LogLevel level, std::string_view message);
+
+// Blocks until every record logged so far has been written.
+void flush_logs();
+
+// Kept for existing callers: Info, or Error when is_error is set.
+void log(const std::string& message, bool is_error = false);
+
+#define MYSERVER_LOG_AT(level_value, level, message) \
+    do { \
+        if constexpr (MYSERVER_MIN_LOG_LEVEL <= (level_value)) { \
+            if (log_enabled(level)) log_record(level, (message)); \
+        } \
+    } while (0)
+
+#define LOG_DEBUG(message) MYSERVER_LOG_AT(0, LogLevel::Debug, message)
+#define LOG_INFO(message) MYSERVER_LOG_AT(1, LogLevel::Info, message)
+#define LOG_ERROR(message) MYSERVER_LOG_AT(2, LogLevel::Error, message)
+
+#endif //MYSERVER_LOGGER_H
@@ -0,0 +1,361 @@
+#ifndef MYSERVER_MEMBERSHIP_H
+#define MYSERVER_MEMBERSHIP_H
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <functional>
+#include <map>
+#include <memory>
+#include <position.pb.h>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "BufferPool.h"
+#include "Connection.h"
+#include "Digest.h"
+#include "Frame.h"
+#include "peer.h"
+#include "utils.h"
+
+using boost::asio::ip::tcp;
+namespace asio = boost::asio;
+
+// Membership service. A registry process keeps the list of live peers: every peer holds one TCP
+// session to it, announces itself with a Join, and is sent the whole Membership each time it
+// changes. A member leaves when its session closes. The registry only tells peers whom to dial;
+// positions never pass through it, so peers keep their connections while it is away and join it
+// again once it is back.
+
+constexpr std::size_t kRegistryBufferSize = 16 * 1024;
+constexpr std::size_t kMaxRegistryBacklog = 4 * 1024 * 1024;
+
+
+// Whom self dials, given the current members. Without relays the members form a full mesh in
+// which each pair is connected once, by the member whose name sorts later. With relays, the
+// relays form that mesh among themselves and every other member dials only one relay, picked by
+// rendezvous hashing, so a relay joining or leaving moves just the members it gains or loses.
+inline std::vector<Member> dial_targets(const Member& self, const Membership& view) {
+    std::vector<Member> targets;
+    if (!self.relay()) {
+        const Member* best = nullptr;
+        uint64_t best_score = 0;
+        uint64_t self_key = symbol_key(self.name());
+        for (const Member& member : view.members()) {
+            if (!member.relay() || member.name() == self.name()) continue;
+            uint64_t score = mix64(symbol_key(member.name()) ^ self_key);
+            if (!best || score > best_score) {
+                best = &member;
+                best_score = score;
+            }
+        }
+        if (best) {
+            targets.push_back(*best);
+            return targets;
+        }
+    }
+    for (const Member& member : view.members()) {
+        if (member.name() < self.name() && member.relay() == self.relay()) {
+            targets.push_back(member);
+        }
+    }
+    return targets;
+}
+
+
+// One registry session, on either end. Frames are read and written through a Connection, and
+// everything runs on the socket's io_context thread.
+class RegistrySession : public std::enable_shared_from_this<RegistrySession> {
+public:
+    using FrameHandler = std::function<void(const FrameView&)>;
+    using CloseHandler = std::function<void()>;
+
+    RegistrySession(std::shared_ptr<tcp::socket> socket, std::shared_ptr<BufferPool> buffers):
+            connection(std::move(socket), std::move(buffers))
+    {}
+
+    // Reads frames until the session fails, then calls on_close once.
+    void start(FrameHandler on_frame, CloseHandler on_close) {
+        on_frame_ = std::move(on_frame);
+        on_close_ = std::move(on_close);
+        read();
+    }
+
+    void send(const SharedFrame& frame) {
+        if (!frame || closed_) return;
+        switch (connection.enqueue(frame, kMaxRegistryBacklog)) {
+            case Connection::EnqueueResult::StartWrite:
+                write();
+                break;
+            case Connection::EnqueueResult::Overflow:
+                log("[RegistrySession::send] Send queue to " + connection.name + " overflowed, closing", true);
+                close();
+                break;
+            case Connection::EnqueueResult::Queued:
+            case Connection::EnqueueResult::Dropped:
+                break;
+        }
+    }
+
+    void close() {
+        if (closed_) return;
+        closed_ = true;
+        boost::system::error_code ignored;
+        connection.socket->close(ignored);
+        CloseHandler on_close = std::move(on_close_);
+        on_frame_ = nullptr;
+        if (on_close) on_close();
+    }
+
+    Connection connection;
+
+private:
+    void read() {
+        auto self = shared_from_this();
+        connection.socket->async_read_some(connection.prepare_read(),
+                [self](boost::system::error_code ec, std::size_t bytes_read) {
+                    if (ec || self->closed_) {
+                        self->close();
+                        return;
+                    }
+                    bool valid = self->connection.commit_read(bytes_read, [&self](const FrameView& frame) {
+                        if (self->on_frame_) self->on_frame_(frame);
+                    });
+                    if (!valid || self->closed_) {
+                        self->close();
+                        return;
+                    }
+                    self->read();
+                });
+    }
+
+    void write() {
+        auto self = shared_from_this();
+        asio::async_write(*connection.socket, connection.begin_write(),
+                          [self](boost::system::error_code ec, std::size_t) {
+                              if (ec) {
+                                  self->close();
+                                  return;
+                              }
+                              if (self->connection.finish_write()) self->write();
+                          });
+    }
+
+    FrameHandler on_frame_;
+    CloseHandler on_close_;
+    bool closed_ = false;
+};
+
+
+// The registry. Single threaded: everything runs on the io_context it is given.
+class Registry {
+public:
+    Registry(asio::io_context& io, unsigned short port):
+            io_(io),
+            acceptor_(io, tcp::endpoint(tcp::v4(), port)),
+            buffers_(std::make_shared<BufferPool>(kRegistryBufferSize, kMaxPooledReadBuffers))
+    {
+        log("[Registry::Registry] Membership registry listening on port " + std::to_string(port));
+        accept();
+    }
+
+private:
+    struct Entry {
+        Member member;
+        RegistrySession* session;
+    };
+
+    void accept() {
+        auto socket = std::make_shared<tcp::socket>(io_);
+        acceptor_.async_accept(*socket, [this, socket](boost::system::error_code ec) {
+            if (ec == asio::error::operation_aborted) return;
+            if (ec) {
+                log("[Registry::accept] Accept error: " + ec.message(), true);
+            } else {
+                // A member whose host vanishes without closing its socket is noticed by keepalive.
+                boost::system::error_code ignored;
+                socket->set_option(tcp::socket::keep_alive(true), ignored);
+                auto session = std::make_shared<RegistrySession>(socket, buffers_);
+                RegistrySession* raw = session.get();
+                sessions_.emplace(raw, session);
+                LOG_DEBUG("[Registry::accept] Session from " + session->connection.name);
+                session->start([this, raw](const FrameView& frame) { handle(raw, frame); },
+                               [this, raw]() { leave(raw); });
+            }
+            accept();
+        });
+    }
+
+    void handle(RegistrySession* session, const FrameView& frame) {
+        Member member;
+        if (frame.type != MessageType::Join || !member.ParseFromArray(frame.data, static_cast<int>(frame.size))
+            || member.name().empty() || member.port() == 0 || member.port() > 65535) {
+            log("[Registry::handle] Unexpected " + to_string(frame.type) + " from " + session->connection.name + ", closing", true);
+            session->close();
+            return;
+        }
+        if (member.host().empty()) {
+            boost::system::error_code ec;
+            auto remote = session->connection.socket->remote_endpoint(ec);
+            if (!ec) member.set_host(remote.address().to_string());
+        }
+        // A session joins under one name at a time.
+        for (auto it = members_.begin(); it != members_.end();) {
+            it = it->second.session == session && it->first != member.name() ? members_.erase(it) : std::next(it);
+        }
+        // The latest Join of a name wins, e.g. a restarted peer whose old session has not closed yet.
+        Entry& entry = members_[member.name()];
+        if (entry.session && entry.session != session) {
+            log("[Registry::handle] " + member.name() + " joined again from " + session->connection.name
+                + ", replacing its session from " + entry.session->connection.name);
+        }
+        entry = Entry{member, session};
+        log("[Registry::handle] " + member.name() + " joined at " + member.host() + ":" + std::to_string(member.port())
+            + (member.relay() ? " as a relay" : ""));
+        publish();
+    }
+
+    void leave(RegistrySession* session) {
+        std::size_t before = members_.size();
+        for (auto it = members_.begin(); it != members_.end();) {
+            if (it->second.session == session) {
+                log("[Registry::leave] " + it->first + " left");
+                it = members_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        // The session stays alive until its last handler returns.
+        sessions_.erase(session);
+        if (members_.size() != before) publish();
+    }
+
+    // Sends the whole list to every member; it is small and changes rarely.
+    void publish() {
+        Membership view;
+        view.set_version(++version_);
+        std::set<RegistrySession*> joined;
+        for (const auto& [_, entry] : members_) {
+            *view.add_members() = entry.member;
+            joined.insert(entry.session);
+        }
+        SharedFrame frame = make_frame(MessageType::Membership, view);
+        for (RegistrySession* session : joined) {
+            session->send(frame);
+        }
+    }
+
+    asio::io_context& io_;
+    tcp::acceptor acceptor_;
+    std::shared_ptr<BufferPool> buffers_;
+    std::map<RegistrySession*, std::shared_ptr<RegistrySession>> sessions_;
+    std::map<std::string, Entry> members_;
+    uint64_t version_ = 0;
+};
+
+
+// A peer's side of the registry. Joins as self, and on every Membership tells the Peer which
+// members to keep connections to (see dial_targets). The session to the registry is kept open
+// like any peer connection, retried with backoff forever; while it is down, the last membership
+// stays in force.
+class MembershipClient {
+public:
+    MembershipClient(asio::io_context& io, std::shared_ptr<Peer> peer, std::string registry_host,
+                     unsigned short registry_port, Member self):
+            io_(io),
+            peer_(std::move(peer)),
+            registry_host_(std::move(registry_host)),
+            registry_port_(registry_port),
+            self_(std::move(self)),
+            buffers_(std::make_shared<BufferPool>(kRegistryBufferSize, 1)),
+            retry_timer_(io)
+    {}
+
+    void start() {
+        asio::post(io_, [this] { connect(); });
+    }
+
+private:
+    void connect() {
+        auto socket = std::make_shared<tcp::socket>(io_);
+        tcp::resolver resolver(io_);
+        boost::system::error_code resolve_ec;
+        auto endpoints = resolver.resolve(registry_host_, std::to_string(registry_port_), resolve_ec);
+        if (resolve_ec) {
+            log("[MembershipClient::connect] Resolve failed for registry " + registry_host_ + ": " + resolve_ec.message(), true);
+            retry_later();
+            return;
+        }
+        asio::async_connect(*socket, endpoints, [this, socket](const boost::system::error_code& ec, const tcp::endpoint&) {
+            if (ec) {
+                log("[MembershipClient::connect] Registry " + registry_host_ + ":" + std::to_string(registry_port_)
+                    + " unreachable: " + ec.message(), true);
+                retry_later();
+                return;
+            }
+            backoff_ = kMinReconnectDelay;
+            session_ = std::make_shared<RegistrySession>(socket, buffers_);
+            log("[MembershipClient::connect] Joining registry at " + session_->connection.name + " as " + self_.name());
+            session_->start([this](const FrameView& frame) { handle(frame); },
+                            [this]() {
+                                log("[MembershipClient::connect] Lost the registry, keeping the last membership", true);
+                                session_.reset();
+                                retry_later();
+                            });
+            session_->send(make_frame(MessageType::Join, self_));
+        });
+    }
+
+    void retry_later() {
+        retry_timer_.expires_after(backoff_);
+        backoff_ = std::min(backoff_ * 2, kMaxReconnectDelay);
+        retry_timer_.async_wait([this](const boost::system::error_code& ec) {
+            if (!ec) connect();
+        });
+    }
+
+    void handle(const FrameView& frame) {
+        Membership view;
+        if (frame.type != MessageType::Membership || !view.ParseFromArray(frame.data, static_cast<int>(frame.size))) {
+            log("[MembershipClient::handle] Unexpected " + to_string(frame.type) + " from the registry", true);
+            return;
+        }
+        apply(view);
+    }
+
+    // A target that is no longer wanted although its member is still there, e.g. because a
+    // member moved to another relay, is disconnected. One whose member left is only no longer
+    // dialled: if the registry lost it by mistake, the connection survives until it rejoins.
+    void apply(const Membership& view) {
+        std::set<std::string> present;
+        for (const Member& member : view.members()) {
+            present.insert(member.name());
+        }
+        std::set<std::string> wanted;
+        std::string names;
+        for (const Member& target : dial_targets(self_, view)) {
+            wanted.insert(target.name());
+            names += (names.empty() ? "" : ", ") + target.name();
+            peer_->maintain_peer(target.name(), target.host(), static_cast<unsigned short>(target.port()));
+        }
+        for (const std::string& name : dialled_) {
+            if (!wanted.count(name)) peer_->forget_peer(name, present.count(name) > 0);
+        }
+        dialled_ = std::move(wanted);
+        log("[MembershipClient::apply] Membership " + std::to_string(view.version()) + " has "
+            + std::to_string(view.members_size()) + " members, connecting to " + (names.empty() ? "none" : names));
+    }
+
+    asio::io_context& io_;
+    std::shared_ptr<Peer> peer_;
+    std::string registry_host_;
+    unsigned short registry_port_;
+    Member self_;
+    std::shared_ptr<BufferPool> buffers_;
+    std::shared_ptr<RegistrySession> session_;
+    asio::steady_timer retry_timer_;
+    std::chrono::milliseconds backoff_{kMinReconnectDelay};
+    std::set<std::string> dialled_;
+};
+
+#endif //MYSERVER_MEMBERSHIP_H
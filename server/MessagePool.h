@@ -0,0 +1,45 @@
+#ifndef MYSERVER_MESSAGEPOOL_H
+#define MYSERVER_MESSAGEPOOL_H
+
+#include <boost/lockfree/spsc_queue.hpp>
+#include <cstdint>
+#include <vector>
+
+
+// Fixed set of preallocated messages shared by exactly one producer and one consumer. The
+// producer acquires a free slot, fills it in place and passes the slot index on; the consumer
+// releases the slot once it is done with it. Slots are reused, so protobuf messages keep their
+// string capacity and memory stays flat however many messages go through.
+template<typename T>
+class MessagePool {
+public:
+    explicit MessagePool(std::size_t capacity): slots_(capacity), free_(capacity) {
+        for (uint32_t slot = 0; slot < capacity; ++slot) {
+            free_.push(slot);
+        }
+    }
+
+    // Producer side. Returns false when every slot is in flight.
+    bool try_acquire(uint32_t& slot) {
+        return free_.pop(slot);
+    }
+
+    // Consumer side.
+    void release(uint32_t slot) {
+        free_.push(slot);
+    }
+
+    T& operator[](uint32_t slot) {
+        return slots_[slot];
+    }
+
+    std::size_t capacity() const {
+        return slots_.size();
+    }
+
+private:
+    std::vector<T> slots_;
+    boost::lockfree::spsc_queue<uint32_t> free_;
+};
+
+#endif //MYSERVER_MESSAGEPOOL_H
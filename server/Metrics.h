@@ -0,0 +1,156 @@
+#ifndef MYSERVER_METRICS_H
+#define MYSERVER_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <utility>
+
+
+// Metrics are owned by the thread that updates them: a shard's worker, a lane's producer or a
+// connection's network thread. With a single writer an update is a relaxed load and store, with
+// no locked instruction and no shared cache line, and any other thread can still read a
+// consistent value when it renders the metrics.
+
+namespace metrics {
+
+inline int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+
+// Monotonic counter with a single writer.
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const {
+        return value_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+
+// Latency histogram with a single writer. Bucket i counts values up to 256ns << i, which covers
+// 256ns to about 8.6s in 26 buckets; anything longer only lands in +Inf.
+class LatencyHistogram {
+public:
+    static constexpr std::size_t kBuckets = 26;
+    static constexpr int kFirstBucketBits = 8;
+
+    void record(int64_t ns) {
+        uint64_t v = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+        std::size_t bucket = v <= (uint64_t{1} << kFirstBucketBits)
+                             ? 0 : static_cast<std::size_t>(std::bit_width(v - 1) - kFirstBucketBits);
+        if (bucket < kBuckets) buckets_[bucket].add();
+        count_.add();
+        sum_ns_.add(v);
+    }
+
+    static uint64_t upper_bound_ns(std::size_t bucket) {
+        return uint64_t{1} << (kFirstBucketBits + bucket);
+    }
+
+    uint64_t bucket(std::size_t index) const { return buckets_[index].value(); }
+    uint64_t count() const { return count_.value(); }
+    uint64_t sum_ns() const { return sum_ns_.value(); }
+
+private:
+    std::array<Counter, kBuckets> buckets_;
+    Counter count_;
+    Counter sum_ns_;
+};
+
+
+using MetricLabels = std::initializer_list<std::pair<std::string_view, std::string_view>>;
+
+// Renders metrics in the Prometheus text exposition format. Every family is announced once with
+// family() and its samples follow it directly.
+class MetricsWriter {
+public:
+    void family(std::string_view name, std::string_view type, std::string_view help) {
+        out_.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        out_.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    }
+
+    void sample(std::string_view name, MetricLabels labels, double value) {
+        out_.append(name);
+        append_labels(labels, {});
+        out_.append(" ").append(format(value)).append("\n");
+    }
+
+    // A histogram family of latencies, exposed in seconds.
+    void histogram(std::string_view name, MetricLabels labels, const LatencyHistogram& histogram) {
+        std::string bucket_name = std::string(name) + "_bucket";
+        uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < LatencyHistogram::kBuckets; ++i) {
+            cumulative += histogram.bucket(i);
+            out_.append(bucket_name);
+            append_labels(labels, format(static_cast<double>(LatencyHistogram::upper_bound_ns(i)) / 1e9));
+            out_.append(" ").append(std::to_string(cumulative)).append("\n");
+        }
+        uint64_t count = histogram.count();
+        out_.append(bucket_name);
+        append_labels(labels, "+Inf");
+        out_.append(" ").append(std::to_string(count)).append("\n");
+        out_.append(name).append("_sum");
+        append_labels(labels, {});
+        out_.append(" ").append(format(static_cast<double>(histogram.sum_ns()) / 1e9)).append("\n");
+        out_.append(name).append("_count");
+        append_labels(labels, {});
+        out_.append(" ").append(std::to_string(count)).append("\n");
+    }
+
+    const std::string& str() const {
+        return out_;
+    }
+
+private:
+    static std::string format(double value) {
+        char buffer[32];
+        int size = std::snprintf(buffer, sizeof(buffer), "%.15g", value);
+        return std::string(buffer, static_cast<std::size_t>(size));
+    }
+
+    void append_labels(MetricLabels labels, std::string_view le) {
+        if (labels.size() == 0 && le.empty()) return;
+        out_.push_back('{');
+        bool first = true;
+        auto append = [&](std::string_view key, std::string_view value) {
+            if (!first) out_.push_back(',');
+            first = false;
+            out_.append(key).append("=\"");
+            for (char c : value) {
+                if (c == '\\' || c == '"') out_.push_back('\\');
+                if (c == '\n') {
+                    out_.append("\\n");
+                    continue;
+                }
+                out_.push_back(c);
+            }
+            out_.push_back('"');
+        };
+        for (const auto& [key, value] : labels) {
+            append(key, value);
+        }
+        if (!le.empty()) append("le", le);
+        out_.push_back('}');
+    }
+
+    std::string out_;
+};
+
+#endif //MYSERVER_METRICS_H
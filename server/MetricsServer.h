@@ -0,0 +1,112 @@
+#ifndef MYSERVER_METRICSSERVER_H
+#define MYSERVER_METRICSSERVER_H
+
+#include <boost/asio.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+#include "Metrics.h"
+#include "utils.h"
+
+namespace asio = boost::asio;
+
+
+// Serves the Prometheus text format over a minimal HTTP/1.0 responder, on a loopback TCP port
+// and/or a Unix socket (curl --unix-socket PATH http://localhost/metrics). It runs on its own
+// thread and io_context, so a scrape never delays the network threads; collecting only reads
+// the single-writer counters.
+class MetricsServer {
+public:
+    using Collector = std::function<void(MetricsWriter&)>;
+
+    static constexpr std::size_t kMaxRequestSize = 8 * 1024;
+
+    explicit MetricsServer(Collector collect):
+            collect_(std::move(collect)),
+            work_(asio::make_work_guard(io_))
+    {}
+
+    ~MetricsServer() {
+        work_.reset();
+        io_.stop();
+        if (thread_.joinable()) thread_.join();
+        if (!unix_path_.empty()) ::unlink(unix_path_.c_str());
+    }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    void listen_tcp(unsigned short port) {
+        tcp_acceptor_ = std::make_unique<asio::ip::tcp::acceptor>(
+                io_, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port));
+        log("[MetricsServer::listen_tcp] Serving metrics on http://127.0.0.1:" + std::to_string(port) + "/metrics");
+        accept(*tcp_acceptor_);
+    }
+
+    void listen_unix(const std::string& path) {
+        ::unlink(path.c_str());
+        unix_acceptor_ = std::make_unique<asio::local::stream_protocol::acceptor>(
+                io_, asio::local::stream_protocol::endpoint(path));
+        unix_path_ = path;
+        log("[MetricsServer::listen_unix] Serving metrics on unix socket " + path);
+        accept(*unix_acceptor_);
+    }
+
+    void start() {
+        thread_ = std::thread([this] { io_.run(); });
+    }
+
+private:
+    template<typename Acceptor>
+    void accept(Acceptor& acceptor) {
+        acceptor.async_accept([this, &acceptor](const boost::system::error_code& ec, typename Acceptor::protocol_type::socket socket) {
+            if (!ec) {
+                serve(std::make_shared<typename Acceptor::protocol_type::socket>(std::move(socket)));
+            } else if (ec == asio::error::operation_aborted) {
+                return;
+            }
+            accept(acceptor);
+        });
+    }
+
+    template<typename Socket>
+    void serve(std::shared_ptr<Socket> socket) {
+        auto request = std::make_shared<asio::streambuf>(kMaxRequestSize);
+        asio::async_read_until(*socket, *request, "\r\n\r\n",
+                               [this, socket, request](const boost::system::error_code& ec, std::size_t) {
+            if (ec) return;
+            auto data = request->data();
+            std::string head(asio::buffers_begin(data), asio::buffers_end(data));
+            auto reply = std::make_shared<std::string>(respond(head.substr(0, head.find("\r\n"))));
+            asio::async_write(*socket, asio::buffer(*reply), [socket, reply](const boost::system::error_code&, std::size_t) {
+                boost::system::error_code ignored;
+                socket->shutdown(Socket::shutdown_both, ignored);
+                socket->close(ignored);
+            });
+        });
+    }
+
+    std::string respond(const std::string& request_line) {
+        if (request_line.rfind("GET /metrics ", 0) != 0 && request_line.rfind("GET / ", 0) != 0) {
+            return "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        }
+        MetricsWriter writer;
+        collect_(writer);
+        const std::string& body = writer.str();
+        return "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+               + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    }
+
+    Collector collect_;
+    asio::io_context io_;
+    asio::executor_work_guard<asio::io_context::executor_type> work_;
+    std::unique_ptr<asio::ip::tcp::acceptor> tcp_acceptor_;
+    std::unique_ptr<asio::local::stream_protocol::acceptor> unix_acceptor_;
+    std::string unix_path_;
+    std::thread thread_;
+};
+
+#endif //MYSERVER_METRICSSERVER_H
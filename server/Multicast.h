@@ -0,0 +1,140 @@
+#ifndef MYSERVER_MULTICAST_H
+#define MYSERVER_MULTICAST_H
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Frame.h"
+#include "Metrics.h"
+#include "utils.h"
+
+namespace asio = boost::asio;
+
+
+// UDP multicast fan-out. Every peer joins the same group and publishes each broadcast frame
+// once, as one datagram, instead of writing it to N sockets; the kernel copies it to every
+// member. UDP may drop or reorder datagrams, so what is sent here must carry sequence numbers
+// the receiver can check (see Engine::note_received), and anything lost is recovered over TCP.
+//
+// Sending binds outgoing datagrams to interface (e.g. 127.0.0.1 to keep a test on loopback)
+// and keeps multicast loopback on, so several distributors on one host all receive each other.
+class MulticastChannel {
+public:
+    // Largest frame sent as a datagram; larger ones take the TCP path. Keep broadcasts well
+    // below the path MTU with --coalesce-max on a real network to avoid IP fragmentation.
+    static constexpr std::size_t kMaxDatagramSize = 65000;
+    // After a receive error the next receive waits this long, and errors are logged at most
+    // once per kReceiveErrorLogInterval.
+    static constexpr std::chrono::milliseconds kReceiveRetryDelay{100};
+    static constexpr std::chrono::seconds kReceiveErrorLogInterval{5};
+
+    using Handler = std::function<void(const FrameView&)>;
+
+    MulticastChannel(asio::io_context& io, const std::string& group, unsigned short port, const std::string& interface):
+            group_(asio::ip::make_address_v4(group), port),
+            socket_(io),
+            retry_timer_(io),
+            receive_buffer_(kMaxDatagramSize + 1)
+    {
+        asio::ip::address_v4 interface_address = interface.empty()
+                                                 ? asio::ip::address_v4::any() : asio::ip::make_address_v4(interface);
+        socket_.open(asio::ip::udp::v4());
+        socket_.set_option(asio::ip::udp::socket::reuse_address(true));
+        socket_.bind(asio::ip::udp::endpoint(asio::ip::address_v4::any(), port));
+        socket_.set_option(asio::ip::multicast::join_group(group_.address().to_v4(), interface_address));
+        socket_.set_option(asio::ip::multicast::enable_loopback(true));
+        socket_.set_option(asio::ip::multicast::hops(1));
+        if (!interface.empty()) {
+            socket_.set_option(asio::ip::multicast::outbound_interface(interface_address));
+        }
+        log("[MulticastChannel::MulticastChannel] Joined multicast group " + group + ":" + std::to_string(port)
+            + (interface.empty() ? std::string() : " on " + interface));
+    }
+
+    // Delivers every well-formed frame received on the group to on_frame, on the socket's
+    // io_context thread.
+    void start(Handler on_frame) {
+        on_frame_ = std::move(on_frame);
+        receive();
+    }
+
+    // Callers serialise sends. Returns false if the frame is too large for a datagram or the
+    // send failed, in which case the caller should fall back to TCP.
+    bool send(const SharedFrame& frame) {
+        if (frame->size() > kMaxDatagramSize) return false;
+        boost::system::error_code ec;
+        socket_.send_to(asio::buffer(*frame), group_, 0, ec);
+        if (ec) {
+            send_errors.add();
+            return false;
+        }
+        datagrams_sent.add();
+        return true;
+    }
+
+    Counter datagrams_sent;       // written under the caller's send lock
+    Counter send_errors;
+    Counter datagrams_received;   // written on the receiving thread
+    Counter datagrams_dropped;    // malformed or truncated
+    Counter receive_errors;
+
+private:
+    void receive() {
+        socket_.async_receive_from(asio::buffer(receive_buffer_), sender_,
+                                   [this](const boost::system::error_code& ec, std::size_t size) {
+            if (ec == asio::error::operation_aborted) return;
+            if (!ec) {
+                datagrams_received.add();
+                FrameHeader header{};
+                if (size >= kFrameHeaderSize && size <= kMaxDatagramSize && decode_frame_header(receive_buffer_.data(), header)
+                    && kFrameHeaderSize + header.length == size) {
+                    on_frame_(FrameView{header.type, receive_buffer_.data() + kFrameHeaderSize, header.length, header.flags});
+                } else {
+                    datagrams_dropped.add();
+                }
+            } else {
+                receive_failed(ec);
+                return;
+            }
+            receive();
+        });
+    }
+
+    // A socket that is gone or unusable stays that way, so receiving stops; anything else, such
+    // as an interface going down for a while, is retried after kReceiveRetryDelay. Broadcasts
+    // missed meanwhile are recovered over TCP like any other lost datagram.
+    void receive_failed(const boost::system::error_code& ec) {
+        receive_errors.add();
+        if (ec == asio::error::bad_descriptor || ec == asio::error::not_socket
+            || ec == asio::error::operation_not_supported || ec == asio::error::invalid_argument) {
+            log("[MulticastChannel::receive_failed] Receive error: " + ec.message() + ", no longer receiving multicast", true);
+            return;
+        }
+        ++unlogged_errors_;
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_error_log_ >= kReceiveErrorLogInterval) {
+            log("[MulticastChannel::receive_failed] Receive error: " + ec.message() + " ("
+                + std::to_string(unlogged_errors_) + " since the last report), retrying", true);
+            unlogged_errors_ = 0;
+            last_error_log_ = now;
+        }
+        retry_timer_.expires_after(kReceiveRetryDelay);
+        retry_timer_.async_wait([this](const boost::system::error_code& timer_ec) {
+            if (timer_ec != asio::error::operation_aborted) receive();
+        });
+    }
+
+    asio::ip::udp::endpoint group_;
+    asio::ip::udp::socket socket_;
+    asio::ip::udp::endpoint sender_;
+    asio::steady_timer retry_timer_;
+    std::chrono::steady_clock::time_point last_error_log_{};
+    uint64_t unlogged_errors_ = 0;
+    std::vector<char> receive_buffer_;
+    Handler on_frame_;
+};
+
+#endif //MYSERVER_MULTICAST_H
@@ -0,0 +1,156 @@
+#ifndef MYSERVER_POSITIONTABLE_H
+#define MYSERVER_POSITIONTABLE_H
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <numeric>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+constexpr std::size_t kCacheLineSize = 64;
+
+
+// Assigns dense integer ids to names (strategies, symbols). Names are only ever added, so
+// an id handed out stays valid for the lifetime of the interner and name(id) can be read
+// without taking the lock.
+class Interner {
+public:
+    static constexpr uint32_t npos = std::numeric_limits<uint32_t>::max();
+
+    explicit Interner(std::size_t capacity): capacity_(capacity), size_(0) {
+        names_.reserve(capacity);
+        ids_.reserve(capacity);
+    }
+
+    uint32_t find(const std::string& name) const {
+        std::shared_lock lock(mutex_);
+        auto it = ids_.find(name);
+        return it == ids_.end() ? npos : it->second;
+    }
+
+    // Returns the id of name, adding it if unseen. Returns npos once the interner is full.
+    uint32_t intern(const std::string& name) {
+        uint32_t id = find(name);
+        if (id != npos) return id;
+
+        std::unique_lock lock(mutex_);
+        auto it = ids_.find(name);
+        if (it != ids_.end()) return it->second;
+        if (names_.size() >= capacity_) return npos;
+
+        id = static_cast<uint32_t>(names_.size());
+        names_.push_back(name);
+        ids_.emplace(name, id);
+        size_.store(id + 1, std::memory_order_release);
+        return id;
+    }
+
+    const std::string& name(uint32_t id) const {
+        return names_[id];
+    }
+
+    uint32_t size() const {
+        return size_.load(std::memory_order_acquire);
+    }
+
+    std::size_t capacity() const {
+        return capacity_;
+    }
+
+private:
+    std::size_t capacity_;
+    std::atomic<uint32_t> size_;
+    std::vector<std::string> names_;
+    std::unordered_map<std::string, uint32_t> ids_;
+    mutable std::shared_mutex mutex_;
+};
+
+
+struct Position {
+    double net_position = 0;
+    int64_t timestamp = 0;   // 0 means the slot has never been written
+    uint64_t seq = 0;        // owner's sequence number, 0 if unknown
+};
+
+
+// Flat (strategy_id, symbol_id) -> Position table. Every strategy owns one row of
+// symbol_capacity() slots; rows start on a cache line boundary so a strategy's
+// positions never share a line with another strategy's.
+class PositionTable {
+public:
+    // Row lengths are a multiple of this, the fewest Positions that fill whole cache lines.
+    static constexpr std::size_t kRowMultiple = kCacheLineSize / std::gcd(kCacheLineSize, sizeof(Position));
+
+    PositionTable(std::size_t max_strategies, std::size_t max_symbols):
+            strategies_(max_strategies),
+            symbols_(max_symbols),
+            row_stride_(round_up(max_symbols, kRowMultiple)),
+            cells_(allocate(max_strategies * row_stride_))
+    {}
+
+    Interner& strategies() { return strategies_; }
+    Interner& symbols() { return symbols_; }
+    const Interner& strategies() const { return strategies_; }
+    const Interner& symbols() const { return symbols_; }
+
+    Position& at(uint32_t strategy_id, uint32_t symbol_id) {
+        return cells_.get()[strategy_id * row_stride_ + symbol_id];
+    }
+
+    const Position& at(uint32_t strategy_id, uint32_t symbol_id) const {
+        return cells_.get()[strategy_id * row_stride_ + symbol_id];
+    }
+
+    // Visits every populated slot of a single strategy as f(symbol_id, position).
+    template<typename F>
+    void for_each_in_row(uint32_t strategy_id, F&& f) const {
+        const Position* row = cells_.get() + strategy_id * row_stride_;
+        uint32_t symbol_count = symbols_.size();
+        for (uint32_t symbol_id = 0; symbol_id < symbol_count; ++symbol_id) {
+            if (row[symbol_id].timestamp != 0) {
+                f(symbol_id, row[symbol_id]);
+            }
+        }
+    }
+
+    // Visits every populated slot as f(strategy_id, symbol_id, position).
+    template<typename F>
+    void for_each(F&& f) const {
+        uint32_t strategy_count = strategies_.size();
+        for (uint32_t strategy_id = 0; strategy_id < strategy_count; ++strategy_id) {
+            for_each_in_row(strategy_id, [&](uint32_t symbol_id, const Position& position) {
+                f(strategy_id, symbol_id, position);
+            });
+        }
+    }
+
+private:
+    struct AlignedDelete {
+        void operator()(Position* p) const {
+            ::operator delete[](p, std::align_val_t{kCacheLineSize});
+        }
+    };
+
+    static std::size_t round_up(std::size_t n, std::size_t multiple) {
+        return (n + multiple - 1) / multiple * multiple;
+    }
+
+    static std::unique_ptr<Position[], AlignedDelete> allocate(std::size_t n) {
+        auto* cells = static_cast<Position*>(
+                ::operator new[](n * sizeof(Position), std::align_val_t{kCacheLineSize}));
+        std::uninitialized_value_construct_n(cells, n);
+        return std::unique_ptr<Position[], AlignedDelete>(cells);
+    }
+
+    Interner strategies_;
+    Interner symbols_;
+    std::size_t row_stride_;
+    std::unique_ptr<Position[], AlignedDelete> cells_;
+};
+
+#endif //MYSERVER_POSITIONTABLE_H
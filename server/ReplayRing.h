@@ -0,0 +1,57 @@
+#ifndef MYSERVER_REPLAYRING_H
+#define MYSERVER_REPLAYRING_H
+
+#include <cstdint>
+#include <vector>
+
+
+// The last capacity own position updates, indexed by sequence number, kept so a reconnecting
+// peer can be sent just the updates it missed. Sequence numbers are pushed in increasing order;
+// a jump forgets everything before it. Not thread safe; Engine guards it with its publish lock.
+class ReplayRing {
+public:
+    struct Entry {
+        uint64_t seq;
+        uint32_t shard;
+        uint32_t symbol_id;
+        double net_position;
+        int64_t timestamp;
+    };
+
+    explicit ReplayRing(std::size_t capacity): entries_(capacity > 0 ? capacity : 1) {}
+
+    void push(const Entry& entry) {
+        if (size_ > 0 && entry.seq != first_seq_ + size_) {
+            size_ = 0;  // the sequence jumped; nothing before the jump can be replayed
+        }
+        if (size_ == 0) {
+            first_seq_ = entry.seq;
+        } else if (size_ == entries_.size()) {
+            ++first_seq_;
+        }
+        entries_[entry.seq % entries_.size()] = entry;
+        if (size_ < entries_.size()) ++size_;
+    }
+
+    // True if every update after seq up to the newest entry is still held.
+    bool covers(uint64_t seq) const {
+        return size_ > 0 && seq + 1 >= first_seq_;
+    }
+
+    // Visits the entries after seq, newest first, as f(const Entry&).
+    template<typename F>
+    void for_each_after(uint64_t seq, F&& f) const {
+        if (size_ == 0) return;
+        uint64_t last = first_seq_ + size_ - 1;
+        for (uint64_t s = last; s > seq && s >= first_seq_; --s) {
+            f(entries_[s % entries_.size()]);
+        }
+    }
+
+private:
+    std::vector<Entry> entries_;
+    std::size_t size_ = 0;
+    uint64_t first_seq_ = 0;
+};
+
+#endif //MYSERVER_REPLAYRING_H
@@ -0,0 +1,111 @@
+#ifndef MYSERVER_SHARD_H
+#define MYSERVER_SHARD_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <functional>
+#include <mutex>
+#include <position.pb.h>
+#include <string>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "Coalescer.h"
+#include "Digest.h"
+#include "Exposure.h"
+#include "Journal.h"
+#include "MessagePool.h"
+#include "Metrics.h"
+#include "PositionTable.h"
+#include "WaitStrategy.h"
+
+
+// Single-producer single-consumer channel into a shard. Messages live in a fixed pool and the
+// queue carries slot indices. The worker releases a slot while consume_all is still running and
+// only moves the queue's read index once the whole batch is done, so a released slot can be
+// acquired and pushed again while its old index still occupies the queue. Sizing the queue at
+// twice the pool covers that, and the producer only ever waits for a free slot.
+template<typename T>
+struct Lane {
+    explicit Lane(std::size_t capacity): pool(capacity), queue(2 * capacity), enqueued_at(capacity) {}
+
+    MessagePool<T> pool;
+    boost::lockfree::spsc_queue<uint32_t> queue;
+    std::vector<int64_t> enqueued_at;     // per slot, steady clock ns, written before the slot is queued
+
+    // Producer side.
+    alignas(kCacheLineSize) Counter enqueued;
+    Counter full_waits;                   // waits for a free slot because the lane was full
+    // Consumer side.
+    alignas(kCacheLineSize) Counter dequeued;
+
+    std::size_t depth() const {
+        return enqueued.value() - std::min(enqueued.value(), dequeued.value());
+    }
+};
+
+
+// A single-writer slice of the engine. Every symbol is owned by exactly one shard, and only
+// that shard's worker thread touches its table, so updates for a symbol are applied in order
+// without locks.
+//
+// Every producer thread gets its own lane into every shard, which keeps all queues SPSC:
+// lane 0 belongs to the local trade ingress thread and lane i + 1 to network thread i.
+struct Shard {
+    Shard(std::size_t index, std::size_t lane_count, std::size_t queue_capacity, std::size_t max_strategies,
+          std::size_t max_symbols, const std::string& strategy_name, std::chrono::microseconds coalesce_window,
+          std::size_t coalesce_max_batch, const ExposureLimits& limits):
+            index(index),
+            table(max_strategies, max_symbols),
+            self_id(table.strategies().intern(strategy_name)),
+            digest(table.symbols(), max_strategies, max_symbols),
+            exposure(max_symbols, limits),
+            coalescer(coalesce_window, coalesce_max_batch, max_symbols)
+    {
+        for (std::size_t i = 0; i < lane_count; ++i) {
+            trade_lanes.push_back(std::make_unique<Lane<Trade>>(queue_capacity));
+            position_lanes.push_back(std::make_unique<Lane<SymbolPos>>(queue_capacity));
+        }
+    }
+
+    std::size_t index;
+    std::vector<std::unique_ptr<Lane<Trade>>> trade_lanes;
+    std::vector<std::unique_ptr<Lane<SymbolPos>>> position_lanes;
+    PositionTable table;
+    uint32_t self_id;
+    ShardDigest digest;
+    ShardExposure exposure;
+    Signal data_ready;     // producers -> worker: a queue became non-empty
+    Signal space_ready;    // worker -> producers: a pool slot was released
+    Coalescer coalescer;
+    PositionBatch outgoing_batch;     // reused across flushes to keep its allocations
+    std::thread worker;
+    std::unique_ptr<WriteAheadLog> wal;     // null when persistence is off
+    uint64_t log_generation = 0;            // generation wal writes to
+    Coalescer::Clock::time_point next_snapshot;
+    std::atomic<bool> snapshot_in_flight{false};   // set until the snapshot writer is done with this shard
+    LatencyHistogram trade_latency;       // enqueue to processed, per message
+    LatencyHistogram position_latency;
+    Counter broadcasts;                   // PositionBatch frames sent by flush_positions
+    std::array<Counter, kLimitCheckKinds> rejected_trades;   // by LimitCheck
+
+    // Work that has to run on the worker thread, such as reading the table for a query. The
+    // worker only takes the lock when has_tasks is set.
+    std::mutex tasks_mutex;
+    std::vector<std::function<void()>> tasks;
+    std::atomic<bool> has_tasks{false};
+};
+
+// A shard only holds the symbols that hash to it, so its tables are sized for its share of
+// max_symbols plus a quarter for an uneven hash, rather than for the whole book. A shard that
+// still fills up drops updates for new symbols and logs that its table is full.
+inline std::size_t shard_symbol_capacity(std::size_t max_symbols, std::size_t shard_count) {
+    if (shard_count <= 1) return max_symbols;
+    std::size_t share = (max_symbols + shard_count - 1) / shard_count;
+    return std::min(max_symbols, share + share / 4 + 64);
+}
+
+#endif //MYSERVER_SHARD_H
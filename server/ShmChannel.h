@@ -0,0 +1,294 @@
+#ifndef MYSERVER_SHMCHANNEL_H
+#define MYSERVER_SHMCHANNEL_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "PositionTable.h"
+#include "utils.h"
+
+// Shared-memory transport between two peers on the same host. One segment in /dev/shm holds a
+// ring per direction; each ring is single producer (the sending process, serialised by its
+// Connection) and single consumer (the receiving connection's network thread). The TCP
+// connection the peers already share stays open: it carries the handshake, detects a dead
+// peer, and carries a doorbell frame whenever the other side is idle and has to be woken. A
+// busy reader never arms its doorbell, so under load frames cross without any syscall.
+//
+// The segment is a named file rather than a memfd because the peers only share a TCP socket,
+// over which a file descriptor cannot be passed. The name is unlinked as soon as both sides have
+// mapped it, so nothing is left behind once the connection goes away.
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+              "shared-memory rings need address-free atomics");
+
+struct ShmRingHeader {
+    alignas(kCacheLineSize) std::atomic<uint64_t> head;            // bytes ever written, producer only
+    alignas(kCacheLineSize) std::atomic<uint64_t> tail;            // bytes ever read, consumer only
+    alignas(kCacheLineSize) std::atomic<uint32_t> reader_waiting;  // consumer is idle and wants a doorbell
+    std::atomic<uint32_t> writer_waiting;                          // producer has frames waiting for space
+};
+
+
+// A byte ring of whole frames. Records are [u32 size][u32 kind][frame], padded to 8 bytes, and
+// never wrap: a record that does not fit before the end is preceded by a wrap marker, so a
+// frame is always contiguous and can be handed to the receiver in place.
+class ShmRing {
+public:
+    static constexpr std::size_t kRecordHeaderSize = 8;
+
+    ShmRing(ShmRingHeader* header, char* data, uint64_t capacity):
+            header_(header),
+            data_(data),
+            capacity_(capacity)
+    {}
+
+    // Frames up to this size always fit once the ring has drained.
+    std::size_t max_frame() const {
+        return capacity_ / 2 - kRecordHeaderSize;
+    }
+
+    // Producer side. Returns false, writing nothing, if the frame does not fit right now.
+    bool try_write(const std::string& frame) {
+        uint64_t record = record_size(frame.size());
+        uint64_t head = header_->head.load(std::memory_order_relaxed);
+        uint64_t tail = header_->tail.load(std::memory_order_seq_cst);
+        uint64_t offset = head & (capacity_ - 1);
+        uint64_t contiguous = capacity_ - offset;
+        uint64_t needed = record <= contiguous ? record : contiguous + record;
+        if (capacity_ - (head - tail) < needed) return false;
+
+        if (record > contiguous) {
+            write_record_header(offset, 0, kWrap);
+            head += contiguous;
+            offset = 0;
+        }
+        write_record_header(offset, static_cast<uint32_t>(frame.size()), kFrame);
+        std::memcpy(data_ + offset + kRecordHeaderSize, frame.data(), frame.size());
+        header_->head.store(head + record, std::memory_order_seq_cst);
+        return true;
+    }
+
+    // Producer side, after writing: true if the consumer was idle and has to be woken.
+    bool take_reader_waiting() {
+        return header_->reader_waiting.load(std::memory_order_seq_cst) != 0
+               && header_->reader_waiting.exchange(0, std::memory_order_seq_cst) != 0;
+    }
+
+    // Producer side: ask for a doorbell once the consumer frees space. Set before retrying a
+    // write, so space freed in between is either seen by the retry or answered with a doorbell.
+    void set_writer_waiting(bool waiting) {
+        header_->writer_waiting.store(waiting ? 1 : 0, std::memory_order_seq_cst);
+    }
+
+    // Consumer side. Calls f(const char* frame, std::size_t size) for every frame available,
+    // in place; the bytes are released once f returns. The other process writes the ring, so
+    // nothing read from it is trusted: returns false on a record that does not fit what was
+    // published or the ring, after which the channel must be closed.
+    template<typename F>
+    bool read(F&& f) {
+        uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+        uint64_t head = header_->head.load(std::memory_order_acquire);
+        while (tail != head) {
+            uint64_t available = head - tail;
+            uint64_t offset = tail & (capacity_ - 1);
+            if (available > capacity_ || available < kRecordHeaderSize) return false;
+            uint32_t size, kind;
+            std::memcpy(&size, data_ + offset, sizeof(size));
+            std::memcpy(&kind, data_ + offset + sizeof(size), sizeof(kind));
+            if (kind == kWrap) {
+                if (capacity_ - offset > available) return false;
+                tail += capacity_ - offset;
+            } else if (kind == kFrame) {
+                if (record_size(size) > available || offset + kRecordHeaderSize + size > capacity_) return false;
+                f(static_cast<const char*>(data_ + offset + kRecordHeaderSize), static_cast<std::size_t>(size));
+                tail += record_size(size);
+            } else {
+                return false;
+            }
+            header_->tail.store(tail, std::memory_order_seq_cst);
+            if (tail == head) head = header_->head.load(std::memory_order_acquire);
+        }
+        return true;
+    }
+
+    // Consumer side, after reading: true if the producer was waiting for space and has to be woken.
+    bool take_writer_waiting() {
+        return header_->writer_waiting.load(std::memory_order_seq_cst) != 0
+               && header_->writer_waiting.exchange(0, std::memory_order_seq_cst) != 0;
+    }
+
+    // Consumer side: arms the doorbell. Returns false, disarmed, if a frame arrived meanwhile
+    // and the caller has to read again.
+    bool sleep() {
+        header_->reader_waiting.store(1, std::memory_order_seq_cst);
+        if (header_->head.load(std::memory_order_seq_cst) != header_->tail.load(std::memory_order_relaxed)) {
+            header_->reader_waiting.store(0, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr uint32_t kFrame = 0;
+    static constexpr uint32_t kWrap = 1;
+
+    static uint64_t record_size(std::size_t frame_size) {
+        return (kRecordHeaderSize + frame_size + 7) & ~uint64_t{7};
+    }
+
+    void write_record_header(uint64_t offset, uint32_t size, uint32_t kind) {
+        std::memcpy(data_ + offset, &size, sizeof(size));
+        std::memcpy(data_ + offset + sizeof(size), &kind, sizeof(kind));
+    }
+
+    ShmRingHeader* header_;
+    char* data_;
+    uint64_t capacity_;
+};
+
+
+// One mapped segment: the creator sends on ring 0 and receives on ring 1, the peer that opens
+// it the other way round.
+class ShmChannel {
+public:
+    static constexpr uint64_t kMagic = 0x314D48534450ull;   // "PDSHM1"
+
+    // Creates and maps a new segment with two rings of at least ring_bytes each (rounded up to
+    // a power of two). Returns nullptr, after logging, on failure.
+    static std::unique_ptr<ShmChannel> create(std::size_t ring_bytes) {
+        static std::atomic<uint64_t> next_id{0};
+        std::random_device random;
+        uint64_t nonce = (static_cast<uint64_t>(random()) << 32) ^ random() ^ static_cast<uint64_t>(::getpid());
+        std::string path = "/dev/shm/position-distributor-" + std::to_string(::getpid()) + "-"
+                           + std::to_string(next_id.fetch_add(1, std::memory_order_relaxed)) + "-"
+                           + std::to_string(nonce & 0xFFFFFF);
+
+        uint64_t capacity = 4096;
+        while (capacity < ring_bytes) capacity <<= 1;
+        std::size_t size = data_offset() + 2 * capacity;
+
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            log("[ShmChannel::create] Cannot create " + path + ": " + std::strerror(errno), true);
+            if (fd >= 0) {
+                ::close(fd);
+                ::unlink(path.c_str());
+            }
+            return nullptr;
+        }
+        void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            log("[ShmChannel::create] Cannot map " + path + ": " + std::strerror(errno), true);
+            ::unlink(path.c_str());
+            return nullptr;
+        }
+
+        auto* segment = new (memory) SegmentHeader{};
+        segment->magic = kMagic;
+        segment->nonce = nonce;
+        segment->ring_capacity = capacity;
+        for (ShmRingHeader& ring : segment->rings) {
+            ring.reader_waiting.store(1, std::memory_order_relaxed);   // the first frame rings the doorbell
+        }
+        return std::unique_ptr<ShmChannel>(new ShmChannel(path, memory, size, 0));
+    }
+
+    // Maps a segment created by the peer. Returns nullptr unless it exists and carries nonce,
+    // which proves both processes see the same /dev/shm.
+    static std::unique_ptr<ShmChannel> open(const std::string& path, uint64_t nonce) {
+        if (path.rfind("/dev/shm/position-distributor-", 0) != 0 || path.find("/..") != std::string::npos) {
+            return nullptr;
+        }
+        int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) return nullptr;
+        struct stat st{};
+        void* memory = MAP_FAILED;
+        std::size_t size = 0;
+        if (::fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= data_offset()) {
+            size = static_cast<std::size_t>(st.st_size);
+            memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (memory == MAP_FAILED) return nullptr;
+
+        const auto* segment = static_cast<const SegmentHeader*>(memory);
+        uint64_t capacity = segment->ring_capacity;
+        if (segment->magic != kMagic || segment->nonce != nonce || capacity == 0 || (capacity & (capacity - 1)) != 0
+            || size != data_offset() + 2 * capacity) {
+            ::munmap(memory, size);
+            return nullptr;
+        }
+        return std::unique_ptr<ShmChannel>(new ShmChannel("", memory, size, 1));
+    }
+
+    ~ShmChannel() {
+        unlink();
+        ::munmap(memory_, size_);
+    }
+
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+
+    // Removes the segment's name once the peer has mapped it (or declined it). The mapping
+    // stays valid.
+    void unlink() {
+        if (!path_.empty()) {
+            ::unlink(path_.c_str());
+            path_.clear();
+        }
+    }
+
+    const std::string& path() const { return path_; }
+    uint64_t nonce() const { return header()->nonce; }
+    ShmRing& outbound() { return outbound_; }
+    ShmRing& inbound() { return inbound_; }
+
+private:
+    struct SegmentHeader {
+        uint64_t magic;
+        uint64_t nonce;
+        uint64_t ring_capacity;
+        ShmRingHeader rings[2];
+    };
+
+    static constexpr std::size_t data_offset() {
+        return (sizeof(SegmentHeader) + kCacheLineSize - 1) / kCacheLineSize * kCacheLineSize;
+    }
+
+    ShmChannel(std::string path, void* memory, std::size_t size, int send_ring):
+            path_(std::move(path)),
+            memory_(memory),
+            size_(size),
+            outbound_(ring(send_ring)),
+            inbound_(ring(1 - send_ring))
+    {}
+
+    SegmentHeader* header() const {
+        return static_cast<SegmentHeader*>(memory_);
+    }
+
+    ShmRing ring(int index) const {
+        uint64_t capacity = header()->ring_capacity;
+        char* data = static_cast<char*>(memory_) + data_offset() + static_cast<std::size_t>(index) * capacity;
+        return ShmRing(&header()->rings[index], data, capacity);
+    }
+
+    std::string path_;     // empty once unlinked, and for the side that opened the segment
+    void* memory_;
+    std::size_t size_;
+    ShmRing outbound_;
+    ShmRing inbound_;
+};
+
+#endif //MYSERVER_SHMCHANNEL_H
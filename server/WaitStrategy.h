@@ -0,0 +1,167 @@
+#ifndef MYSERVER_WAITSTRATEGY_H
+#define MYSERVER_WAITSTRATEGY_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+
+// Wakeup channel between a producer and a consumer. The waiting side reads epoch() before it
+// polls its queue, and only sleeps if nobody has called notify() since, so a notify that
+// races with going to sleep is never lost. Sleeping is a futex wait on the epoch word.
+class Signal {
+public:
+    uint32_t epoch() const {
+        return epoch_.load(std::memory_order_seq_cst);
+    }
+
+    void wait(uint32_t seen_epoch, std::chrono::nanoseconds timeout) {
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        if (epoch_.load(std::memory_order_seq_cst) == seen_epoch) {
+#ifdef __linux__
+            timespec ts{};
+            ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+            ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), FUTEX_WAIT_PRIVATE, seen_epoch, &ts, nullptr, 0);
+#else
+            std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(timeout, std::chrono::microseconds(50)));
+#endif
+        }
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void notify() {
+        epoch_.fetch_add(1, std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_seq_cst) > 0) {
+#ifdef __linux__
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&epoch_), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#endif
+        }
+    }
+
+private:
+    alignas(64) std::atomic<uint32_t> epoch_{0};
+    std::atomic<uint32_t> waiters_{0};
+};
+
+
+enum class WaitStrategyType {
+    BusySpin,   // lowest latency, burns a full core per waiting thread; needs a core per thread
+    Backoff,    // spin with pause, then yield, then short sleeps
+    Blocking    // brief spin, then futex sleep until notified
+};
+
+inline WaitStrategyType parse_wait_strategy(const std::string& name) {
+    if (name == "spin") return WaitStrategyType::BusySpin;
+    if (name == "backoff") return WaitStrategyType::Backoff;
+    if (name == "block") return WaitStrategyType::Blocking;
+    throw std::invalid_argument("Unknown wait strategy " + name + ". Expected: spin, backoff or block");
+}
+
+inline std::string to_string(WaitStrategyType type) {
+    switch (type) {
+        case WaitStrategyType::BusySpin: return "spin";
+        case WaitStrategyType::Backoff: return "backoff";
+        case WaitStrategyType::Blocking: return "block";
+    }
+    return "unknown";
+}
+
+
+// How a thread waits when its queue is empty (consumer) or full (producer). Usage:
+//
+//     unsigned spins = 0;
+//     while (true) {
+//         uint32_t epoch = signal.epoch();
+//         if (try_make_progress()) break;
+//         wait_strategy.wait(signal, epoch, spins);
+//     }
+//
+// and the other side calls wait_strategy.notify(signal) after making progress.
+class WaitStrategy {
+public:
+    static constexpr unsigned kSpinLimit = 128;
+    static constexpr unsigned kYieldLimit = kSpinLimit + 64;
+    static constexpr std::chrono::microseconds kBackoffSleep{50};
+    static constexpr std::chrono::milliseconds kMaxBlockingWait{100};
+
+    explicit WaitStrategy(WaitStrategyType type = WaitStrategyType::Backoff): type_(type) {}
+
+    WaitStrategyType type() const {
+        return type_;
+    }
+
+    // timeout bounds how long a blocking wait may sleep, so callers can recheck their own
+    // deadlines and shutdown flags.
+    void wait(Signal& signal, uint32_t seen_epoch, unsigned& spins,
+              std::chrono::nanoseconds timeout = kMaxBlockingWait) const {
+        switch (type_) {
+            case WaitStrategyType::BusySpin:
+                // On a core of its own the yield returns at once. When the threads outnumber the
+                // cores it hands the core to the other side instead of burning the time slice
+                // the other side needs to make progress.
+                if (++spins % kSpinLimit == 0) {
+                    std::this_thread::yield();
+                } else {
+                    cpu_relax();
+                }
+                return;
+            case WaitStrategyType::Backoff:
+                if (spins < kSpinLimit) {
+                    ++spins;
+                    cpu_relax();
+                } else if (spins < kYieldLimit) {
+                    ++spins;
+                    std::this_thread::yield();
+                } else {
+                    std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(timeout, kBackoffSleep));
+                }
+                return;
+            case WaitStrategyType::Blocking:
+                if (spins < kSpinLimit) {
+                    ++spins;
+                    cpu_relax();
+                } else {
+                    signal.wait(seen_epoch, timeout);
+                }
+                return;
+        }
+    }
+
+    // Only the blocking strategy has sleepers to wake; the others skip the atomic increment.
+    void notify(Signal& signal) const {
+        if (type_ == WaitStrategyType::Blocking) {
+            signal.notify();
+        }
+    }
+
+private:
+    WaitStrategyType type_;
+};
+
+#endif //MYSERVER_WAITSTRATEGY_H
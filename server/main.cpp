@@ -3,28 +3,107 @@
 
 #include "peer.h"
 #include "Engine.h"
+#include "Ingest.h"
+#include "Membership.h"
+#include "MetricsServer.h"
 
-void print_trade(const Trade& trade) {
+std::string trade_str(const Trade& trade) {
     std::string trade_str;
     google::protobuf::TextFormat::PrintToString(trade, &trade_str);
-    log("Parsed Trade:\n" + trade_str);
+    return trade_str;
 }
 
 int main(int argc, char* argv[]) {
     try {
-        if (argc < 3) {
-            std::cerr << "Usage: " << argv[0] << " <strategy name> <listen_port> [connect_host:port...]\n";
+        std::vector<std::string> args;
+        auto flags = parse_flags(argc, argv, args);
+        if (args.size() < 2) {
+            std::cerr << "Usage: " << argv[0] << " [options] <strategy name> <listen_port> [connect_host:port...]\n"
+                      << "Options:\n"
+                      << "  --shards=N                   engine shards (default 1)\n"
+                      << "  --pin-core=K                 pin shard i to core K + i\n"
+                      << "  --wait=spin|backoff|block    shard wait strategy (default backoff)\n"
+                      << "  --coalesce-us=N              broadcast coalescing window (default 0)\n"
+                      << "  --coalesce-max=N             max positions per broadcast batch (default 256)\n"
+                      << "  --io-threads=N               network threads (default 1)\n"
+                      << "  --io-pin-core=K              pin network thread i to core K + i\n"
+                      << "  --send-hwm=bytes             close peers with more unsent bytes than this\n"
+                      << "  --no-shm                     keep connections to peers on this host on TCP\n"
+                      << "  --shm-ring-bytes=N           shared-memory ring size per direction (default 1MB)\n"
+                      << "  --multicast=GROUP:PORT       publish broadcasts once on a UDP multicast group, e.g. 239.255.0.1:30001\n"
+                      << "  --multicast-if=ADDR          interface address to multicast on, e.g. 127.0.0.1 for loopback\n"
+                      << "  --registry=HOST:PORT         join the membership registry and connect to the peers it lists\n"
+                      << "  --advertise=HOST             address other peers dial, default the one the registry sees\n"
+                      << "  --relay                      fan broadcasts out to the peers that connect to this one\n"
+                      << "  --limits=FILE                reject own trades past the firm exposure limits in FILE\n"
+                      << "  --data-dir=DIR               persist positions to DIR and recover them on restart\n"
+                      << "  --snapshot-s=N               seconds between snapshots (default 60)\n"
+                      << "  --no-fsync                   do not fsync the write-ahead log and snapshots\n"
+                      << "  --gossip-ms=N                anti-entropy interval, 0 disables (default 1000)\n"
+                      << "  --replay-ring=N              own updates kept for reconnecting peers (default 65536)\n"
+                      << "  --metrics-port=P             serve Prometheus metrics on http://127.0.0.1:P/metrics\n"
+                      << "  --metrics-socket=PATH        serve Prometheus metrics over HTTP on a Unix socket\n"
+                      << "  --feed-socket=PATH           take binary trade records from producers on a Unix socket\n"
+                      << "  --replay=FILE                replay the trades in FILE\n"
+                      << "  --replay-format=text|binary  format of the replay file (default text)\n"
+                      << "  --replay-rate=N              replay N trades per second, 0 = as fast as possible (default 0)\n"
+                      << "  --debug                      log every trade, message and position update\n";
             return 1;
         }
 
-        std::string strategy_name(argv[1]);
-        asio::io_context io_context;
-        std::shared_ptr<Peer> peer = std::make_shared<Peer>(io_context, std::stoi(argv[2]));
-        Engine engine(peer, std::move(strategy_name));
+        if (flags.count("debug")) set_log_level(LogLevel::Debug);
+
+        EngineConfig config;
+        if (flags.count("shards")) config.shard_count = std::stoul(flags["shards"]);
+        if (flags.count("pin-core")) config.first_core = std::stoi(flags["pin-core"]);
+        if (flags.count("wait")) config.wait_strategy = parse_wait_strategy(flags["wait"]);
+        if (flags.count("coalesce-us")) config.coalesce_window = std::chrono::microseconds(std::stol(flags["coalesce-us"]));
+        if (flags.count("coalesce-max")) config.coalesce_max_batch = std::stoul(flags["coalesce-max"]);
+        if (flags.count("data-dir")) config.data_dir = flags["data-dir"];
+        if (flags.count("snapshot-s")) config.snapshot_interval = std::chrono::seconds(std::stol(flags["snapshot-s"]));
+        if (flags.count("no-fsync")) config.fsync = false;
+        if (flags.count("replay-ring")) config.replay_ring_capacity = std::stoul(flags["replay-ring"]);
+        if (flags.count("limits")) config.limits = ExposureLimits::load(flags["limits"]);
+        if (flags.count("gossip-ms")) config.gossip_interval = std::chrono::milliseconds(std::stol(flags["gossip-ms"]));
+
+        PeerConfig peer_config;
+        if (flags.count("send-hwm")) peer_config.send_high_water_mark = std::stoul(flags["send-hwm"]);
+        if (flags.count("no-shm")) peer_config.shared_memory = false;
+        if (flags.count("shm-ring-bytes")) peer_config.shm_ring_bytes = std::stoul(flags["shm-ring-bytes"]);
+        if (flags.count("multicast")) {
+            const std::string& group_port = flags["multicast"];
+            size_t colon = group_port.find(':');
+            peer_config.multicast_group = group_port.substr(0, colon);
+            peer_config.multicast_port = static_cast<unsigned short>(std::stoul(group_port.substr(colon + 1)));
+        }
+        if (flags.count("multicast-if")) peer_config.multicast_interface = flags["multicast-if"];
+        if (flags.count("relay")) peer_config.relay = true;
+        peer_config.name = args[0];
+
+        std::size_t io_threads = flags.count("io-threads") ? std::stoul(flags["io-threads"]) : 1;
+        int io_first_core = flags.count("io-pin-core") ? std::stoi(flags["io-pin-core"]) : -1;
+        config.network_threads = io_threads;
+
+        std::string strategy_name(args[0]);
+        auto listen_port = static_cast<unsigned short>(std::stoul(args[1]));
+        IoContextPool io_pool(io_threads, io_first_core);
+        std::shared_ptr<Peer> peer = std::make_shared<Peer>(io_pool, listen_port, peer_config);
+        Engine engine(peer, std::move(strategy_name), config);
+
+        std::unique_ptr<MetricsServer> metrics;
+        if (flags.count("metrics-port") || flags.count("metrics-socket")) {
+            metrics = std::make_unique<MetricsServer>([&engine, &peer](MetricsWriter& out) {
+                engine.write_metrics(out);
+                peer->write_metrics(out);
+            });
+            if (flags.count("metrics-port")) metrics->listen_tcp(static_cast<unsigned short>(std::stoul(flags["metrics-port"])));
+            if (flags.count("metrics-socket")) metrics->listen_unix(flags["metrics-socket"]);
+            metrics->start();
+        }
 
         // Connect to other peers
-        for (int i = 3; i < argc; ++i) {
-            std::string host_port = argv[i];
+        for (size_t i = 2; i < args.size(); ++i) {
+            const std::string& host_port = args[i];
             size_t colon = host_port.find(':');
             peer->connect_to_peer(
                     host_port.substr(0, colon),
@@ -32,35 +111,78 @@ int main(int argc, char* argv[]) {
             );
         }
 
-        // Start IO context in background
-        std::atomic<bool> running{true};
-        std::thread io_thread([&] {
-            while (running) {
-                try {
-                    io_context.run();
-                    running = false;
-                } catch(...) {}
-            }
-        });
+        // And to the ones the registry lists
+        std::unique_ptr<MembershipClient> membership;
+        if (flags.count("registry")) {
+            const std::string& host_port = flags["registry"];
+            size_t colon = host_port.find(':');
+            Member self;
+            self.set_name(peer_config.name);
+            if (flags.count("advertise")) self.set_host(flags["advertise"]);
+            self.set_port(listen_port);
+            self.set_relay(peer_config.relay);
+            membership = std::make_unique<MembershipClient>(io_pool.get_next(), peer, host_port.substr(0, colon),
+                                                            static_cast<unsigned short>(std::stoul(host_port.substr(colon + 1))), self);
+            membership->start();
+        }
+
+        // Start the network threads in background
+        io_pool.run();
+
+        // A feed or replay owns the trade ingress lane on its own thread; stdin then only takes commands.
+        std::unique_ptr<BinaryTradeFeed> feed;
+        std::unique_ptr<FileReplay> replay;
+        std::thread ingest;
+        auto push = [&engine](const Trade& trade) { engine.push_trade(trade); };
+        if (flags.count("feed-socket")) {
+            feed = std::make_unique<BinaryTradeFeed>(flags["feed-socket"]);
+            ingest = std::thread([&feed, &push] { feed->run(push); });
+        } else if (flags.count("replay")) {
+            TradeFormat format = flags.count("replay-format") ? parse_trade_format(flags["replay-format"]) : TradeFormat::Text;
+            uint64_t rate = flags.count("replay-rate") ? std::stoull(flags["replay-rate"]) : 0;
+            replay = std::make_unique<FileReplay>(flags["replay"], format, rate);
+            ingest = std::thread([&replay, &push] { replay->run(push); });
+        }
 
         // Command interface
         std::string message;
+        Trade trade;
         while (std::getline(std::cin, message)) {
             if (message == "exit") break;
+            if (message == "positions") {
+                engine.see_positions();
+                continue;
+            }
+            if (message == "exposure") {
+                log(engine.format_exposure());
+                continue;
+            }
+            if (message == "audit") {
+                ShardExposure::AuditResult audit = engine.audit_exposure();
+                log("Exposure audit: max symbol drift " + std::to_string(audit.max_symbol_error) + ", firm net drift "
+                    + std::to_string(audit.net_error) + ", firm gross drift " + std::to_string(audit.gross_error));
+                continue;
+            }
+            if (ingest.joinable()) {
+                std::cerr << "Error: trades are taken from the feed, stdin only accepts positions, exposure, audit and exit\n\n";
+                continue;
+            }
 
-            try {
-                Trade trade = parse_trade(message);
-                print_trade(trade);
-                engine.push_trade(trade);
-            } catch (const std::exception& e) {
-                std::cerr << "Error: " << e.what() << "\n";
+            if (!parse_trade_line(message, trade)) {
+                std::cerr << "Error: Invalid input format. Expected: SYMBOL POSITION\n";
                 std::cerr << "Valid example: AAPL 100\n\n";
+                continue;
             }
+            LOG_DEBUG("Parsed Trade:\n" + trade_str(trade));
+            engine.push_trade(trade);
         }
 
-        running = false;
-        io_context.stop();
-        io_thread.join();
+        if (feed) feed->stop();
+        if (replay) replay->stop();
+        if (ingest.joinable()) ingest.join();
+
+        io_pool.stop();
+        io_pool.join();
     } catch (std::exception& e) {
         std::cerr << "Exception: " << e.what() << "\n";
     }
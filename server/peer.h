@@ -6,95 +6,263 @@
 #define MYSERVER_PEER_H
 
 #include <boost/asio.hpp>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <unordered_map>
 #include <mutex>
 
 #include "utils.h"
+#include "BufferPool.h"
+#include "Connection.h"
 #include "EventDispatcher.h"
+#include "Frame.h"
+#include "IoContextPool.h"
+#include "Metrics.h"
+#include "Multicast.h"
 
 using boost::asio::ip::tcp;
 namespace asio = boost::asio;
 
+constexpr std::size_t kReadBufferSize = 64 * 1024;
+constexpr std::size_t kMaxPooledReadBuffers = 64;
+// Outgoing connections are retried forever, waiting twice as long after every failure up to the cap.
+constexpr std::chrono::milliseconds kMinReconnectDelay{100};
+constexpr std::chrono::milliseconds kMaxReconnectDelay{5000};
 
+
+struct PeerConfig {
+    // A connection whose unsent frames exceed this many bytes is considered too slow and is closed.
+    std::size_t send_high_water_mark = 16 * 1024 * 1024;
+    // Upgrade connections to peers on the same host to a shared-memory ring per direction.
+    bool shared_memory = true;
+    // Each connection maps two rings of this size; frames over half a ring go over TCP.
+    std::size_t shm_ring_bytes = 1024 * 1024;
+    // Publish broadcasts once on this UDP multicast group instead of on every connection. Empty
+    // keeps broadcasts on TCP.
+    std::string multicast_group;
+    unsigned short multicast_port = 0;
+    std::string multicast_interface;   // address of the interface to send and join on, e.g. 127.0.0.1
+    // Announced to the other end of every connection in a PeerHello; the strategy name.
+    std::string name;
+    // Pass broadcasts received on one connection on to the others, see forward().
+    bool relay = false;
+};
+
+
+// Connections are spread round robin over the io_contexts of an IoContextPool. Everything a
+// connection does runs on its own io_context's thread, so received_message and
+// connection_accepted may be invoked concurrently from different pool threads.
+//
+// When an outgoing connection turns out to reach this host, the connecting side offers a
+// shared-memory channel over it (see ShmChannel.h). If the other side maps it, frames travel
+// through the rings from then on and are still delivered through received_message on the
+// connection's thread; otherwise, or for remote peers, the connection stays plain TCP.
+//
+// Outgoing connections are kept open: a failed attempt is retried with exponential backoff for
+// as long as the target is wanted, and a dropped connection is dialled again. Both ends open a
+// connection with a PeerHello, so each knows the other's name and whether it is a relay.
 class Peer {
 public:
-    Event received_message;
-    Event connection_accepted;
+    Event<const std::shared_ptr<Connection>&, const FrameView&> received_message;
+    // Fires for both accepted and outgoing connections once they are registered.
+    Event<const std::shared_ptr<Connection>&> connection_accepted;
+    // Frames received on the multicast group, including this peer's own, on a pool thread.
+    Event<const FrameView&> received_multicast;
 public:
-    Peer(asio::io_context& io_context, unsigned short port)
-            : acceptor_(io_context, tcp::endpoint(tcp::v4(), port)),
-              io_context_(io_context),
-              strand_(asio::make_strand(io_context)){
+    Peer(IoContextPool& io_pool, unsigned short port, const PeerConfig& config = {})
+            : acceptor_(io_pool.get(0), tcp::endpoint(tcp::v4(), port)),
+              io_pool_(io_pool),
+              send_high_water_mark_(config.send_high_water_mark),
+              shared_memory_(config.shared_memory),
+              shm_ring_bytes_(config.shm_ring_bytes),
+              relay_(config.relay),
+              read_buffers_(std::make_shared<BufferPool>(kReadBufferSize, kMaxPooledReadBuffers)) {
+        Member hello;
+        hello.set_name(config.name);
+        hello.set_port(port);
+        hello.set_relay(config.relay);
+        hello_ = make_frame(MessageType::PeerHello, hello);
         log("[Peer::Peer] Server starting on port " + std::to_string(port));
         start_accept();
+        if (!config.multicast_group.empty()) {
+            multicast_ = std::make_unique<MulticastChannel>(io_pool.get_next(), config.multicast_group,
+                                                            config.multicast_port, config.multicast_interface);
+            multicast_->start([this](const FrameView& frame) { received_multicast(frame); });
+        }
     }
 
-    void connect_to_peer(const std::string& host, unsigned short port, int max_retries = 3, int retry_delay_ms = 5000) {
-        auto socket = std::make_shared<tcp::socket>(io_context_);
-        tcp::resolver resolver(io_context_);
+    void connect_to_peer(const std::string& host, unsigned short port) {
+        maintain_peer(host + ":" + std::to_string(port), host, port);
+    }
 
-        log("[Peer::connect_to_peer] Attempting connection to " + host + ":" + std::to_string(port) + " (retries left: " + std::to_string(max_retries) + ")");
+    // Keeps one outgoing connection to host:port open under the given name until forget_peer.
+    // Calling it again for a name already maintained at the same address does nothing; a new
+    // address replaces the old one.
+    void maintain_peer(const std::string& name, const std::string& host, unsigned short port) {
+        uint64_t generation;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            auto [it, added] = maintained_.try_emplace(name);
+            MaintainedPeer& target = it->second;
+            bool same_address = !added && target.host == host && target.port == port;
+            if (same_address && target.wanted) return;
+            target.wanted = true;
+            target.generation = ++last_generation_;
+            if (same_address && !target.connection.expired()) return;   // still open from before forget_peer
+            target.host = host;
+            target.port = port;
+            target.backoff = kMinReconnectDelay;
+            target.connection.reset();
+            generation = target.generation;
+        }
+        dial(name, generation);
+    }
 
-        boost::system::error_code resolve_ec;
-        auto endpoints = resolver.resolve(host, std::to_string(port), resolve_ec);
-        if (resolve_ec) {
-            log("[Peer::connect_to_peer] Resolve failed for " + host + ":" + std::to_string(port) + ": " + resolve_ec.message(), true);
-            if (max_retries > 0) {
-                log("[Peer::connect_to_peer] Scheduling retry...");
-                schedule_retry(host, port, max_retries - 1, retry_delay_ms);
-            } else {
-                log("[Peer::connect_to_peer] No more retries left for " + host + ":" + std::to_string(port), true);
-            }
-            return;
+    // Stops maintaining the connection to name. With close, an open connection is also closed,
+    // otherwise it stays until it drops by itself and is then not dialled again.
+    void forget_peer(const std::string& name, bool close) {
+        std::shared_ptr<Connection> open;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            auto it = maintained_.find(name);
+            if (it == maintained_.end()) return;
+            it->second.wanted = false;
+            it->second.generation = ++last_generation_;
+            open = it->second.connection.lock();
+            if (!open) maintained_.erase(it);
+        }
+        if (open && close) {
+            log("[Peer::forget_peer] Closing connection to " + name + " at " + open->name);
+            asio::post(open->socket->get_executor(), [this, open]() { close_connection(open); });
         }
+    }
 
-        async_connect(*socket, endpoints,
-                      [this, socket, host, port, max_retries, retry_delay_ms](const boost::system::error_code& ec, const tcp::endpoint& endpoint) {
-                          if (!ec) {
-                              log("[Peer::connect_to_peer] Connected to " + get_host_port_str(socket->remote_endpoint()));
-                              connection_accepted();
-                              std::lock_guard<std::mutex> lock(connections_mutex_);
-                              connections_.emplace(socket, socket);
-                              start_read(socket);
-                          } else {
-                              log("[Peer::connect_to_peer] Connection to " + host + ":" + std::to_string(port) +
-                                  " failed: " + ec.message(), true);
-                              if (max_retries > 0) {
-                                  log("[Peer::connect_to_peer] Scheduling retry (" + std::to_string(max_retries - 1) + " retries left)...");
-                                  schedule_retry(host, port, max_retries - 1, retry_delay_ms);
-                              } else {
-                                  log("[Peer::connect_to_peer] No more retries left for " + host + ":" + std::to_string(port), true);
-                              }
-                          }
-                      });
+    bool relay() const {
+        return relay_;
     }
 
-    void broadcast(const std::string& message) {
-        log("[Peer::broadcast] Broadcasting to all connections");
-        for (auto& [_, socket] : connections_) {
-            send_message(socket, message);
+    // The frame is encoded once and shared by every connection's write queue.
+    void broadcast(const SharedFrame& frame) {
+        LOG_DEBUG("[Peer::broadcast] Broadcasting to all connections");
+        // Called concurrently from every engine shard.
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        for (auto& [_, connection] : connections_) {
+            send_message(connection, frame);
         }
     }
 
-    void send_message(const std::shared_ptr<tcp::socket>& socket, const std::string& message) {
-        uint32_t net_length = htonl(static_cast<uint32_t>(message.size()));
-        auto write_buffer = std::make_shared<std::vector<char>>(sizeof(uint32_t) + message.size());
+    bool multicast_enabled() const {
+        return multicast_ != nullptr;
+    }
 
-        std::memcpy(write_buffer->data(), &net_length, sizeof(uint32_t));
-        std::memcpy(write_buffer->data() + sizeof(uint32_t), message.data(), message.size());
+    // Publishes the frame once on the multicast group. Callers serialise calls. Returns false if
+    // multicast is off or the frame could not go out as a datagram; the caller then broadcasts.
+    bool multicast(const SharedFrame& frame) {
+        return multicast_ && multicast_->send(frame);
+    }
 
-        log("[Peer::send_message] Sending message to " + get_host_port_str(socket->remote_endpoint()));
+    std::vector<std::shared_ptr<Connection>> connections() {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        std::vector<std::shared_ptr<Connection>> result;
+        result.reserve(connections_.size());
+        for (auto& [_, connection] : connections_) {
+            result.push_back(connection);
+        }
+        return result;
+    }
 
-        asio::post(strand_, [socket, write_buffer]() {
-            asio::async_write(*socket, asio::buffer(*write_buffer),
-                              [socket, write_buffer](boost::system::error_code ec, std::size_t /*bytes_transferred*/) {
-                                  if (ec) {
-                                      std::string err = "[Peer::send_message] Write error: " + ec.message();
-                                      log(err, true);
-                                  }
-                              });
-        });
+    // Per-connection traffic and backlog, plus connection counts.
+    void write_metrics(MetricsWriter& out) {
+        std::vector<std::shared_ptr<Connection>> open = connections();
+        struct Family {
+            const char* name;
+            const char* help;
+            const Counter Connection::Stats::* counter;
+        };
+        static constexpr Family kTrafficFamilies[] = {
+                {"distributor_connection_received_bytes_total", "Bytes read from a peer connection.", &Connection::Stats::bytes_received},
+                {"distributor_connection_received_frames_total", "Frames read from a peer connection.", &Connection::Stats::frames_received},
+                {"distributor_connection_sent_bytes_total", "Bytes written to a peer connection.", &Connection::Stats::bytes_sent},
+                {"distributor_connection_sent_frames_total", "Frames written to a peer connection.", &Connection::Stats::frames_sent},
+                {"distributor_connection_shm_sent_bytes_total", "Bytes written to a peer's shared-memory ring.", &Connection::Stats::shm_bytes_sent},
+                {"distributor_connection_shm_sent_frames_total", "Frames written to a peer's shared-memory ring.", &Connection::Stats::shm_frames_sent},
+        };
+        for (const Family& family : kTrafficFamilies) {
+            out.family(family.name, "counter", family.help);
+            for (const auto& connection : open) {
+                out.sample(family.name, {{"connection", connection->name}},
+                           static_cast<double>((connection->stats.*family.counter).value()));
+            }
+        }
+        out.family("distributor_connection_send_backlog_bytes", "gauge", "Bytes queued or in flight on a peer connection.");
+        for (const auto& connection : open) {
+            out.sample("distributor_connection_send_backlog_bytes", {{"connection", connection->name}},
+                       static_cast<double>(connection->queued_bytes()));
+        }
+        out.family("distributor_connection_shared_memory", "gauge", "1 if the connection sends through a shared-memory ring.");
+        for (const auto& connection : open) {
+            out.sample("distributor_connection_shared_memory", {{"connection", connection->name}},
+                       connection->shm() ? 1.0 : 0.0);
+        }
+
+        if (multicast_) {
+            out.family("distributor_multicast_sent_datagrams_total", "counter", "Datagrams published on the multicast group.");
+            out.sample("distributor_multicast_sent_datagrams_total", {}, static_cast<double>(multicast_->datagrams_sent.value()));
+            out.family("distributor_multicast_send_errors_total", "counter", "Multicast sends that failed and fell back to TCP.");
+            out.sample("distributor_multicast_send_errors_total", {}, static_cast<double>(multicast_->send_errors.value()));
+            out.family("distributor_multicast_received_datagrams_total", "counter", "Datagrams received on the multicast group.");
+            out.sample("distributor_multicast_received_datagrams_total", {}, static_cast<double>(multicast_->datagrams_received.value()));
+            out.family("distributor_multicast_dropped_datagrams_total", "counter", "Malformed datagrams received on the multicast group.");
+            out.sample("distributor_multicast_dropped_datagrams_total", {}, static_cast<double>(multicast_->datagrams_dropped.value()));
+            out.family("distributor_multicast_receive_errors_total", "counter", "Failed receives on the multicast group.");
+            out.sample("distributor_multicast_receive_errors_total", {}, static_cast<double>(multicast_->receive_errors.value()));
+        }
+
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        out.family("distributor_peer_connections", "gauge", "Open peer connections.");
+        out.sample("distributor_peer_connections", {}, static_cast<double>(connections_.size()));
+        out.family("distributor_peer_accepted_total", "counter", "Connections accepted from peers.");
+        out.sample("distributor_peer_accepted_total", {}, static_cast<double>(accepted_));
+        out.family("distributor_peer_slow_closes_total", "counter", "Connections closed because their send backlog exceeded the high-water mark.");
+        out.sample("distributor_peer_slow_closes_total", {}, static_cast<double>(slow_connections_closed_.load(std::memory_order_relaxed)));
+        out.family("distributor_peer_maintained_targets", "gauge", "Outgoing connections the peer keeps open.");
+        out.sample("distributor_peer_maintained_targets", {}, static_cast<double>(maintained_.size()));
+        if (relay_) {
+            out.family("distributor_peer_relayed_frames_total", "counter", "Broadcasts passed on to other connections as a relay.");
+            out.sample("distributor_peer_relayed_frames_total", {}, static_cast<double>(relayed_frames_.load(std::memory_order_relaxed)));
+        }
+        out.family("distributor_peer_connect_attempts_total", "counter", "Outgoing connection attempts per target.");
+        for (const auto& [target, stats] : connect_stats_) {
+            out.sample("distributor_peer_connect_attempts_total", {{"target", target}}, static_cast<double>(stats.attempts));
+        }
+        out.family("distributor_peer_connect_failures_total", "counter", "Failed outgoing connection attempts per target.");
+        for (const auto& [target, stats] : connect_stats_) {
+            out.sample("distributor_peer_connect_failures_total", {{"target", target}}, static_cast<double>(stats.failures));
+        }
+        out.family("distributor_peer_reconnects_total", "counter", "Successful outgoing connections per target after the first.");
+        for (const auto& [target, stats] : connect_stats_) {
+            out.sample("distributor_peer_reconnects_total", {{"target", target}},
+                       static_cast<double>(stats.connects > 0 ? stats.connects - 1 : 0));
+        }
+    }
+
+    void send_message(const std::shared_ptr<Connection>& connection, const SharedFrame& frame) {
+        if (!connection->uses_shm(frame)) {
+            send_tcp(connection, frame);
+            return;
+        }
+        switch (connection->enqueue_shm(frame, send_high_water_mark_)) {
+            case Connection::EnqueueResult::StartWrite:
+                ring_doorbell(connection);
+                break;
+            case Connection::EnqueueResult::Overflow:
+                close_slow_connection(connection);
+                break;
+            case Connection::EnqueueResult::Queued:
+            case Connection::EnqueueResult::Dropped:
+                break;
+        }
     }
 
     static std::string get_host_port_str(const tcp::endpoint&& remote_ep) {
@@ -102,38 +270,151 @@ public:
     }
 private:
     tcp::acceptor acceptor_;
-    asio::io_context& io_context_;
-    asio::streambuf buffer_;
-    asio::strand<asio::io_context::executor_type> strand_;
+    IoContextPool& io_pool_;
+    std::size_t send_high_water_mark_;
+    bool shared_memory_;
+    std::size_t shm_ring_bytes_;
+    bool relay_;
+    SharedFrame hello_;
+
+    std::shared_ptr<BufferPool> read_buffers_;
+    std::unique_ptr<MulticastChannel> multicast_;
 
-    std::unordered_map<std::shared_ptr<tcp::socket>, std::shared_ptr<tcp::socket>> connections_;
+    std::unordered_map<Connection*, std::shared_ptr<Connection>> connections_;
     std::mutex connections_mutex_;
 
+    // Outgoing connection attempts per host:port, guarded by connections_mutex_.
+    struct ConnectStats {
+        uint64_t attempts = 0;
+        uint64_t connects = 0;
+        uint64_t failures = 0;
+    };
+    std::map<std::string, ConnectStats> connect_stats_;
+    uint64_t accepted_ = 0;
+    std::atomic<uint64_t> slow_connections_closed_{0};
+    std::atomic<uint64_t> relayed_frames_{0};
+
+    // Outgoing connections kept open, by name, guarded by connections_mutex_. Every change bumps
+    // the generation, which cancels dial attempts and retry timers started before it.
+    struct MaintainedPeer {
+        std::string host;
+        unsigned short port = 0;
+        bool wanted = true;
+        uint64_t generation = 0;
+        std::chrono::milliseconds backoff{kMinReconnectDelay};
+        std::weak_ptr<Connection> connection;
+    };
+    std::map<std::string, MaintainedPeer> maintained_;
+    uint64_t last_generation_ = 0;
+
 private:
-    void schedule_retry(const std::string& host, unsigned short port, int remaining_retries, int retry_delay_ms) {
-        auto timer = std::make_shared<asio::steady_timer>(io_context_);
-        timer->expires_after(std::chrono::milliseconds(retry_delay_ms));
-        timer->async_wait([this, host, port, remaining_retries, retry_delay_ms, timer](const boost::system::error_code& ec) {
+    void dial(const std::string& name, uint64_t generation) {
+        std::string host;
+        unsigned short port;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            auto it = maintained_.find(name);
+            if (it == maintained_.end() || it->second.generation != generation) return;
+            host = it->second.host;
+            port = it->second.port;
+        }
+        std::string target = host + ":" + std::to_string(port);
+        asio::io_context& io_context = io_pool_.get_next();
+        auto socket = std::make_shared<tcp::socket>(io_context);
+        tcp::resolver resolver(io_context);
+
+        log("[Peer::dial] Attempting connection to " + name + (name == target ? "" : " at " + target));
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            ++connect_stats_[target].attempts;
+        }
+
+        boost::system::error_code resolve_ec;
+        auto endpoints = resolver.resolve(host, std::to_string(port), resolve_ec);
+        if (resolve_ec) {
+            log("[Peer::dial] Resolve failed for " + target + ": " + resolve_ec.message(), true);
+            retry_later(name, generation);
+            return;
+        }
+
+        async_connect(*socket, endpoints,
+                      [this, socket, name, generation, target](const boost::system::error_code& ec, const tcp::endpoint&) {
+                          if (ec) {
+                              log("[Peer::dial] Connection to " + target + " failed: " + ec.message(), true);
+                              {
+                                  std::lock_guard<std::mutex> lock(connections_mutex_);
+                                  ++connect_stats_[target].failures;
+                              }
+                              retry_later(name, generation);
+                              return;
+                          }
+                          auto connection = std::make_shared<Connection>(socket, read_buffers_);
+                          connection->dialled = name;
+                          {
+                              std::lock_guard<std::mutex> lock(connections_mutex_);
+                              auto it = maintained_.find(name);
+                              if (it == maintained_.end() || it->second.generation != generation) {
+                                  boost::system::error_code ignored;
+                                  socket->close(ignored);   // forgotten while connecting
+                                  return;
+                              }
+                              it->second.connection = connection;
+                              it->second.backoff = kMinReconnectDelay;
+                              connections_.emplace(connection.get(), connection);
+                              ++connect_stats_[target].connects;
+                          }
+                          log("[Peer::dial] Connected to " + get_host_port_str(socket->remote_endpoint()));
+                          offer_shm(connection);
+                          open_connection(connection);
+                      });
+    }
+
+    // Waits out the target's backoff and dials again, doubling the backoff for the next failure.
+    void retry_later(const std::string& name, uint64_t generation) {
+        std::chrono::milliseconds delay;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            auto it = maintained_.find(name);
+            if (it == maintained_.end() || it->second.generation != generation) return;
+            delay = it->second.backoff;
+            it->second.backoff = std::min(delay * 2, kMaxReconnectDelay);
+        }
+        LOG_DEBUG("[Peer::retry_later] Dialling " + name + " again in " + std::to_string(delay.count()) + "ms");
+        auto timer = std::make_shared<asio::steady_timer>(io_pool_.get_next());
+        timer->expires_after(delay);
+        timer->async_wait([this, name, generation, timer](const boost::system::error_code& ec) {
             if (!ec) {
-                connect_to_peer(host, port, remaining_retries, retry_delay_ms);
+                dial(name, generation);
             } else if (ec != asio::error::operation_aborted) {
-                log("[Peer::schedule_retry] Retry timer error: " + ec.message(), true);
+                log("[Peer::retry_later] Retry timer error: " + ec.message(), true);
             }
         });
     }
 
+    // Both ends introduce themselves before anything else goes out on a new connection.
+    void open_connection(const std::shared_ptr<Connection>& connection) {
+        if (hello_) send_tcp(connection, hello_);
+        connection_accepted(connection);
+        start_read(connection);
+    }
+
+    // The acceptor lives on the first io_context; each accepted socket is bound to the next
+    // io_context in the pool.
     void start_accept() {
-        auto socket = std::make_shared<tcp::socket>(io_context_);
+        auto socket = std::make_shared<tcp::socket>(io_pool_.get_next());
         acceptor_.async_accept(*socket,
                                [this, socket](boost::system::error_code ec) {
                                    if (!ec) {
                                        log("[Peer::start_accept] Accepted connection from " + get_host_port_str(socket->remote_endpoint()));
+                                       auto connection = std::make_shared<Connection>(socket, read_buffers_);
                                        {
                                            std::lock_guard<std::mutex> lock(connections_mutex_);
-                                           connections_.emplace(socket, socket);
+                                           connections_.emplace(connection.get(), connection);
+                                           ++accepted_;
                                        }
-                                       connection_accepted(socket);
-                                       start_read(socket);
+                                       // The handler runs on the acceptor's thread; everything the connection
+                                       // does has to run on the thread of the io_context it is bound to.
+                                       asio::post(socket->get_executor(), [this, connection] { open_connection(connection); });
                                        start_accept();
                                    } else {
                                        log("[Peer::start_accept] Accept error: " + ec.message(), true);
@@ -141,37 +422,255 @@ private:
                                });
     }
 
-    void start_read(const std::shared_ptr<tcp::socket>& socket) {
-        // Allocate local buffer for reading the length.
-        auto size_buffer = std::make_shared<uint32_t>(0);
-
-        asio::async_read(*socket, asio::buffer(size_buffer.get(), sizeof(uint32_t)),
-                         [this, socket, size_buffer](boost::system::error_code ec, std::size_t) {
-                             if (!ec) {
-                                 uint32_t msg_size = ntohl(*size_buffer);
-                                 // Allocate a buffer for the incoming message.
-                                 auto message_buffer = std::make_shared<std::string>();
-                                 message_buffer->resize(msg_size);
-
-                                 asio::async_read(*socket, asio::buffer(&(*message_buffer)[0], msg_size),
-                                                  [this, socket, message_buffer](boost::system::error_code ec, std::size_t) {
-                                                      log("[Peer::start_read] Received a message from " + get_host_port_str(socket->remote_endpoint()));
-                                                      if (!ec) {
-                                                          received_message(*message_buffer);
-                                                          // Start the next read operation using a new local buffer.
-                                                          start_read(socket);
-                                                      } else {
-                                                          log("[Peer::start_read] Connection closed by " + get_host_port_str(socket->remote_endpoint()) + ": " + ec.message());
-                                                          std::lock_guard<std::mutex> lock(connections_mutex_);
-                                                          connections_.erase(socket);
-                                                      }
-                                                  });
-                             } else {
-                                 log("[Peer::start_accept] Connection closed by " + get_host_port_str(socket->remote_endpoint()) + ": " + ec.message());
-                                 std::lock_guard<std::mutex> lock(connections_mutex_);
-                                 connections_.erase(socket);
-                             }
-                         });
+    // One async_read_some fills as much of the connection's buffer as the socket has ready, then
+    // every complete frame in it is dispatched before the next read is issued.
+    void start_read(const std::shared_ptr<Connection>& connection) {
+        connection->socket->async_read_some(connection->prepare_read(),
+                [this, connection](boost::system::error_code ec, std::size_t bytes_read) {
+                    if (ec) {
+                        log("[Peer::start_read] Connection closed by " + connection->name + ": " + ec.message());
+                        close_connection(connection);
+                        return;
+                    }
+
+                    connection->stats.bytes_received.add(bytes_read);
+                    std::size_t frames = 0;
+                    bool valid = connection->commit_read(bytes_read, [this, &connection, &frames](const FrameView& frame) {
+                        ++frames;
+                        if (is_shm_control(frame.type)) {
+                            handle_shm_control(connection, frame);
+                        } else {
+                            dispatch(connection, frame);
+                        }
+                    });
+                    if (!valid) {
+                        log("[Peer::start_read] Dropping connection to " + connection->name + \
+                            ": unsupported frame version or length", true);
+                        close_connection(connection);
+                        return;
+                    }
+                    connection->stats.frames_received.add(frames);
+                    if (frames > 0) {
+                        LOG_DEBUG("[Peer::start_read] Received " + std::to_string(frames) + " message(s) from " + connection->name);
+                    }
+                    start_read(connection);
+                });
+    }
+
+    void dispatch(const std::shared_ptr<Connection>& connection, const FrameView& frame) {
+        if (frame.type == MessageType::PeerHello) {
+            handle_hello(connection, frame);
+            return;
+        }
+        forward(connection, frame);
+        received_message(connection, frame);
+    }
+
+    void handle_hello(const std::shared_ptr<Connection>& connection, const FrameView& frame) {
+        Member hello;
+        if (!hello.ParseFromArray(frame.data, static_cast<int>(frame.size))) {
+            log("[Peer::handle_hello] Could not parse PeerHello from " + connection->name, true);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            connection->member = hello.name();
+            connection->relay = hello.relay();
+        }
+        log("[Peer::handle_hello] " + connection->name + " is " + hello.name() + (hello.relay() ? " (relay)" : ""));
+    }
+
+    // Relay mode. A broadcast from a member that is not a relay goes on to every other
+    // connection; one from another relay only to the members that are not, since that relay has
+    // already sent it to every relay itself. Frames therefore cross at most two relays and never
+    // come back. The payload is copied once and shared by every connection it goes out on.
+    void forward(const std::shared_ptr<Connection>& from, const FrameView& frame) {
+        if (!relay_ || !(frame.flags & kFrameFanOut)) return;
+        SharedFrame copy = make_frame(frame);
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        bool from_relay = from->relay;
+        for (auto& [_, connection] : connections_) {
+            if (connection == from || (from_relay && connection->relay)) continue;
+            send_message(connection, copy);
+        }
+        relayed_frames_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void send_tcp(const std::shared_ptr<Connection>& connection, const SharedFrame& frame) {
+        switch (connection->enqueue(frame, send_high_water_mark_)) {
+            case Connection::EnqueueResult::StartWrite:
+                asio::post(connection->socket->get_executor(), [this, connection]() { write_pending(connection); });
+                break;
+            case Connection::EnqueueResult::Overflow:
+                close_slow_connection(connection);
+                break;
+            case Connection::EnqueueResult::Queued:
+            case Connection::EnqueueResult::Dropped:
+                break;
+        }
+    }
+
+    void close_slow_connection(const std::shared_ptr<Connection>& connection) {
+        log("[Peer::send_message] Send queue to " + connection->name + " exceeded " + \
+            std::to_string(send_high_water_mark_) + " bytes, closing slow connection", true);
+        slow_connections_closed_.fetch_add(1, std::memory_order_relaxed);
+        asio::post(connection->socket->get_executor(), [this, connection]() { close_connection(connection); });
+    }
+
+    void ring_doorbell(const std::shared_ptr<Connection>& connection) {
+        static const SharedFrame doorbell = make_frame(MessageType::ShmDoorbell);
+        send_tcp(connection, doorbell);
+    }
+
+    static bool is_shm_control(MessageType type) {
+        return type == MessageType::ShmOffer || type == MessageType::ShmAccept
+               || type == MessageType::ShmReady || type == MessageType::ShmDoorbell;
+    }
+
+    // Loopback, or a connection to one of this host's own addresses.
+    static bool is_local(const tcp::socket& socket) {
+        boost::system::error_code remote_ec, local_ec;
+        auto remote = socket.remote_endpoint(remote_ec).address();
+        auto local = socket.local_endpoint(local_ec).address();
+        return !remote_ec && !local_ec && (remote.is_loopback() || remote == local);
+    }
+
+    // Connecting side: creates a segment and offers it before anything else is sent.
+    void offer_shm(const std::shared_ptr<Connection>& connection) {
+        if (!shared_memory_ || !is_local(*connection->socket)) return;
+        auto channel = ShmChannel::create(shm_ring_bytes_);
+        if (!channel) return;
+        ShmHandshake offer;
+        offer.set_segment(channel->path());
+        offer.set_nonce(channel->nonce());
+        connection->offered_shm = std::move(channel);
+        send_tcp(connection, make_frame(MessageType::ShmOffer, offer));
+    }
+
+    // The handshake keeps frames in order across the switch: the accepting side answers over TCP
+    // and then writes to the ring, which the connecting side reads only after that answer. The
+    // connecting side sends ShmReady over TCP before its first ring frame, and the accepting side
+    // reads its inbound ring only after ShmReady.
+    void handle_shm_control(const std::shared_ptr<Connection>& connection, const FrameView& frame) {
+        switch (frame.type) {
+            case MessageType::ShmOffer: {
+                ShmHandshake offer;
+                std::unique_ptr<ShmChannel> channel;
+                if (offer.ParseFromArray(frame.data, static_cast<int>(frame.size)) && shared_memory_
+                    && is_local(*connection->socket)) {
+                    channel = ShmChannel::open(offer.segment(), offer.nonce());
+                }
+                ShmHandshake answer;
+                answer.set_accepted(channel != nullptr);
+                send_tcp(connection, make_frame(MessageType::ShmAccept, answer));
+                if (channel) {
+                    log("[Peer::handle_shm_control] Using shared memory for " + connection->name);
+                    connection->attach_shm(std::move(channel));
+                }
+                break;
+            }
+            case MessageType::ShmAccept: {
+                ShmHandshake answer;
+                std::unique_ptr<ShmChannel> channel = std::move(connection->offered_shm);
+                if (!channel) break;
+                channel->unlink();
+                if (!answer.ParseFromArray(frame.data, static_cast<int>(frame.size)) || !answer.accepted()) {
+                    log("[Peer::handle_shm_control] " + connection->name + " declined shared memory, staying on TCP");
+                    break;
+                }
+                log("[Peer::handle_shm_control] Using shared memory for " + connection->name);
+                send_tcp(connection, make_frame(MessageType::ShmReady));
+                connection->attach_shm(std::move(channel));
+                connection->shm_inbound_ready = true;
+                service_shm(connection);
+                break;
+            }
+            case MessageType::ShmReady:
+                connection->shm_inbound_ready = true;
+                service_shm(connection);
+                break;
+            default:
+                service_shm(connection);
+                break;
+        }
+    }
+
+    // Runs on a doorbell: moves our waiting frames into the outbound ring, then dispatches every
+    // frame in the inbound ring in place until it is empty and the doorbell is armed again.
+    void service_shm(const std::shared_ptr<Connection>& connection) {
+        ShmChannel* channel = connection->shm();
+        if (!channel) return;
+        bool wake_peer = connection->flush_shm();
+        if (connection->shm_inbound_ready) {
+            ShmRing& inbound = channel->inbound();
+            bool valid = true;
+            do {
+                std::size_t bytes = 0;
+                std::size_t frames = 0;
+                bool intact = inbound.read([&](const char* data, std::size_t size) {
+                    FrameHeader header{};
+                    if (!valid || size < kFrameHeaderSize || !decode_frame_header(data, header)
+                        || kFrameHeaderSize + header.length != size || is_shm_control(header.type)) {
+                        valid = false;
+                        return;
+                    }
+                    bytes += size;
+                    ++frames;
+                    dispatch(connection, FrameView{header.type, data + kFrameHeaderSize, header.length, header.flags});
+                });
+                if (!intact || !valid) {
+                    log("[Peer::service_shm] Dropping connection to " + connection->name + \
+                        ": malformed " + (intact ? "frame" : "record") + " in shared memory", true);
+                    close_connection(connection);
+                    return;
+                }
+                connection->stats.bytes_received.add(bytes);
+                connection->stats.frames_received.add(frames);
+                if (inbound.take_writer_waiting()) wake_peer = true;
+            } while (!inbound.sleep());
+        }
+        if (wake_peer) ring_doorbell(connection);
+    }
+
+    // Writes every queued frame of a connection with one gather write per batch (writev), and
+    // keeps going until the queue is empty.
+    void write_pending(const std::shared_ptr<Connection>& connection) {
+        const auto& buffers = connection->begin_write();
+        std::size_t frames = buffers.size();
+        asio::async_write(*connection->socket, buffers,
+                          [this, connection, frames](boost::system::error_code ec, std::size_t bytes_transferred) {
+                              if (ec) {
+                                  log("[Peer::write_pending] Write error to " + connection->name + ": " + ec.message(), true);
+                                  close_connection(connection);
+                                  return;
+                              }
+                              connection->stats.bytes_sent.add(bytes_transferred);
+                              connection->stats.frames_sent.add(frames);
+                              if (connection->finish_write()) {
+                                  write_pending(connection);
+                              }
+                          });
+    }
+
+    // Must run on the connection's own io_context. A maintained connection is dialled again.
+    void close_connection(const std::shared_ptr<Connection>& connection) {
+        boost::system::error_code ignored;
+        connection->socket->close(ignored);
+        uint64_t generation = 0;
+        {
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            connections_.erase(connection.get());
+            auto it = maintained_.find(connection->dialled);
+            if (it == maintained_.end() || it->second.connection.lock() != connection) return;
+            if (!it->second.wanted) {
+                maintained_.erase(it);
+                return;
+            }
+            it->second.connection.reset();
+            generation = it->second.generation;
+        }
+        log("[Peer::close_connection] Lost connection to " + connection->dialled + ", reconnecting");
+        retry_later(connection->dialled, generation);
     }
 
 };
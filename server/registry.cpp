@@ -0,0 +1,28 @@
+#include <csignal>
+#include <iostream>
+#include <position.pb.h>
+
+#include "Membership.h"
+
+// Membership registry, see Membership.h. Peers started with --registry=HOST:PORT join it and
+// connect to each other as it tells them.
+int main(int argc, char* argv[]) {
+    try {
+        std::vector<std::string> args;
+        auto flags = parse_flags(argc, argv, args);
+        if (args.size() != 1) {
+            std::cerr << "Usage: " << argv[0] << " [--debug] <listen_port>\n";
+            return 1;
+        }
+        if (flags.count("debug")) set_log_level(LogLevel::Debug);
+
+        asio::io_context io;
+        Registry registry(io, static_cast<unsigned short>(std::stoul(args[0])));
+        asio::signal_set signals(io, SIGINT, SIGTERM);
+        signals.async_wait([&io](const boost::system::error_code&, int) { io.stop(); });
+        io.run();
+    } catch (std::exception& e) {
+        std::cerr << "Exception: " << e.what() << "\n";
+        return 1;
+    }
+}
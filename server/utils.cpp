@@ -1,21 +1,17 @@
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <chrono>
 #include <iomanip>
 #include <sstream>
 #include <iostream>
 
-#include "utils.h"
-
-void log(const std::string& message, bool is_error) {
-    static std::mutex log_mutex;
-    std::lock_guard<std::mutex> lock(log_mutex);
-    auto now = std::chrono::system_clock::now();
-    auto time = std::chrono::system_clock::to_time_t(now);
-    std::stringstream ss;
-    ss << std::put_time(std::localtime(&time), "%Y-%m-%d %X ") << message;
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
-    if (is_error) std::cerr << ss.str() << std::endl;
-    else std::cout << ss.str() << std::endl;
-}
+#include "utils.h"
 
 std::vector<std::string> split(const std::string& s, char delimiter) {
     std::vector<std::string> tokens;
@@ -29,23 +25,70 @@ std::vector<std::string> split(const std::string& s, char delimiter) {
     return tokens;
 }
 
-Trade parse_trade(const std::string& input) {
-    Trade trade;
+std::unordered_map<std::string, std::string> parse_flags(int argc, char* argv[], std::vector<std::string>& positional) {
+    std::unordered_map<std::string, std::string> flags;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg.rfind("--", 0) != 0) {
+            positional.push_back(std::move(arg));
+            continue;
+        }
+        size_t equals = arg.find('=');
+        if (equals == std::string::npos) {
+            flags[arg.substr(2)] = "true";
+        } else {
+            flags[arg.substr(2, equals - 2)] = arg.substr(equals + 1);
+        }
+    }
+    return flags;
+}
 
-    std::vector<std::string> parts = split(input, ' ');
+bool parse_trade_line(std::string_view line, Trade& trade) {
+    auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+    const char* it = line.data();
+    const char* end = it + line.size();
 
-    if (parts.size() != 2) {
-        throw std::invalid_argument("Invalid input format. Expected: SYMBOL POSITION");
-    }
+    while (it != end && is_space(*it)) ++it;
+    const char* symbol = it;
+    while (it != end && !is_space(*it)) ++it;
+    const char* symbol_end = it;
+    while (it != end && is_space(*it)) ++it;
+    const char* number = it;
+    while (it != end && !is_space(*it)) ++it;
+    const char* number_end = it;
+    while (it != end && is_space(*it)) ++it;
+    if (symbol == symbol_end || number == number_end || it != end) return false;
 
-    trade.set_symbol(parts[0]);
+    // from_chars does not take a leading '+', stod did; stod also rejected a sign after it.
+    if (*number == '+' && number + 1 != number_end && number[1] != '-' && number[1] != '+') ++number;
+    double position;
+    auto [parsed, ec] = std::from_chars(number, number_end, position);
+    if (ec != std::errc() || parsed != number_end) return false;
 
-    try {
-        double position = stod(parts[1]);
-        trade.set_position(position);
-    } catch (const std::exception& e) {
-        throw std::invalid_argument("Invalid position value: " + std::string(e.what()));
-    }
+    trade.set_symbol(symbol, static_cast<std::size_t>(symbol_end - symbol));
+    trade.set_position(position);
+    return true;
+}
 
+Trade parse_trade(const std::string& input) {
+    Trade trade;
+    if (!parse_trade_line(input, trade)) {
+        throw std::invalid_argument("Invalid input format. Expected: SYMBOL POSITION");
+    }
     return trade;
+}
+
+void pin_thread_to_core(std::thread& thread, int core) {
+#ifdef __linux__
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(static_cast<unsigned int>(core) % cores, &cpu_set);
+    int rc = pthread_setaffinity_np(thread.native_handle(), sizeof(cpu_set_t), &cpu_set);
+    if (rc != 0) {
+        log("[pin_thread_to_core] Failed to pin thread to core " + std::to_string(core) + ": " + std::to_string(rc), true);
+    }
+#else
+    log("[pin_thread_to_core] Thread affinity not supported on this platform, ignoring core " + std::to_string(core));
+#endif
 }
\ No newline at end of file
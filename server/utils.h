@@ -2,14 +2,28 @@
 #define MYSERVER_UTILS_H
 
 #include <string>
+#include <string_view>
 #include <chrono>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 #include <position.pb.h>
 
-void log(const std::string& message, bool is_error = false);
+#include "Logger.h"
+
 
 std::vector<std::string> split(const std::string& s, char delimiter);
 
+// Splits argv into --name=value flags ("--name" alone maps to "true") and positional arguments.
+std::unordered_map<std::string, std::string> parse_flags(int argc, char* argv[], std::vector<std::string>& positional);
+
+// Parses "<symbol> <position>" into trade with std::from_chars. Reuses trade's storage, so once
+// the symbol capacity is there a line costs no allocation. Returns false on malformed input.
+bool parse_trade_line(std::string_view line, Trade& trade);
+
 Trade parse_trade(const std::string& input);
 
+// Pins a thread to core % hardware_concurrency. No-op on platforms without thread affinity.
+void pin_thread_to_core(std::thread& thread, int core);
+
 #endif //MYSERVER_UTILS_H
\ No newline at end of file